@@ -0,0 +1,73 @@
+#ifndef CLUSTER_ALLOCATIONCOUNTER_H_
+#define CLUSTER_ALLOCATIONCOUNTER_H_
+
+#include <atomic>
+#include <new>
+#include <cstdlib>
+#include <stdint.h>
+
+namespace kmcluster
+{
+  inline std::atomic<uint64_t>& heapAllocationCounter ()
+  {
+    static std::atomic<uint64_t> counter (0);
+    return counter;
+  }
+
+  /**
+   * The number of calls to the global operator new so far.
+   *
+   * The count only moves when exactly one translation unit of the
+   * program defines KMCLUSTER_COUNT_ALLOCATIONS before including this
+   * header, which replaces the global operator new and delete with
+   * counting versions.  Otherwise it stays at zero.
+   */
+  inline uint64_t heapAllocations ()
+  {
+    return heapAllocationCounter().load (std::memory_order_relaxed);
+  }
+}
+
+#ifdef KMCLUSTER_COUNT_ALLOCATIONS
+
+// kept out of line, otherwise the compiler pairs the inlined malloc and
+// free with new and delete at every call site and warns about them
+#define KMCLUSTER_NOINLINE __attribute__((noinline))
+
+KMCLUSTER_NOINLINE void* operator new (std::size_t n)
+{
+  kmcluster::heapAllocationCounter().fetch_add (1, std::memory_order_relaxed);
+  void* p = malloc (n > 0 ? n : 1);
+  if (p == 0)
+    throw std::bad_alloc ();
+  return p;
+}
+
+KMCLUSTER_NOINLINE void* operator new[] (std::size_t n)
+{
+  return operator new (n);
+}
+
+KMCLUSTER_NOINLINE void operator delete (void* p) noexcept
+{
+  free (p);
+}
+
+KMCLUSTER_NOINLINE void operator delete[] (void* p) noexcept
+{
+  free (p);
+}
+
+KMCLUSTER_NOINLINE void operator delete (void* p, std::size_t) noexcept
+{
+  free (p);
+}
+
+KMCLUSTER_NOINLINE void operator delete[] (void* p, std::size_t) noexcept
+{
+  free (p);
+}
+
+#endif  // KMCLUSTER_COUNT_ALLOCATIONS
+
+#endif  // CLUSTER_ALLOCATIONCOUNTER_H_
@@ -0,0 +1,250 @@
+#ifndef CLUSTER_BLOCKEDDISTANCE_H_
+#define CLUSTER_BLOCKEDDISTANCE_H_
+
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <stdint.h>
+#include <cstring>
+
+namespace kmcluster
+{
+  /**
+   * Nearest center search for many points at once, by way of a
+   * matrix multiply.
+   *
+   * The squared distance of point x to center c is expanded as
+   * |x|^2 - 2 x.c + |c|^2, so the distances of a block of points to a
+   * block of centers are one small matrix product plus the two norms.
+   * The product is computed the way a GEMM does it: the points of a
+   * block are packed into panels of MR rows, the centers into panels
+   * of NR columns, and a micro kernel keeps an MR x NR tile of dot
+   * products in registers while it streams over the dimensions, KC at
+   * a time so both panels stay in cache.  Once a tile of distances is
+   * complete, its epilogue folds it into the running minimum of each
+   * point, so the n x k distance matrix never exists.
+   *
+   * The norms and the epilogue are in double; the dot products are in
+   * Scalar.  Buffers are sized by setPoints and reserveCenters, after
+   * which setCenters and assign do not allocate.
+   */
+  template <typename Scalar>
+  class BlockedDistance
+  {
+    // one SIMD register of Scalar, written with the GCC/clang vector
+    // extension.  Left to itself, the optimizer vectorizes the micro
+    // kernel along the dimensions, which needs a shuffle per product;
+    // with explicit vectors it runs along the centers of a panel.
+#ifdef __AVX__
+    typedef Scalar vector_t __attribute__ ((vector_size (32)));
+#else
+    typedef Scalar vector_t __attribute__ ((vector_size (16)));
+#endif
+    static const size_t WIDTH = sizeof(vector_t) / sizeof(Scalar);
+
+  public:
+    static const size_t MR = 4;                     // points per register tile
+    static const size_t NR = 64 / sizeof(Scalar);   // centers per register tile, one cache line
+    static const size_t MC = 64;                    // points per cache block
+    static const size_t NC = 256;                   // centers per cache block
+    static const size_t KC = 256;                   // dimensions per pass of the micro kernel
+
+    BlockedDistance ()
+      : _points (0)
+      , _n (0)
+      , _d (0)
+      , _stride (0)
+      , _k (0)
+      , _pointNorms ()
+      , _centerNorms ()
+      , _packedCenters ()
+      , _packedPoints ()
+      , _tile ()
+      , _best ()
+      , _nearest ()
+    { }
+
+    /**
+     * the n points of dimension d, row major with rows stride apart
+     * (d if 0).  The points are read in place by assign, so they must
+     * outlive it and not move.
+     */
+    void setPoints (const Scalar* x, size_t n, size_t d, size_t stride = 0)
+    {
+      _points = x;
+      _n = n;
+      _d = d;
+      _stride = stride > 0 ? stride : d;
+      _pointNorms.resize (n);
+      for (size_t i=0; i<n; i++)
+        _pointNorms[i] = squaredNorm (x + i*_stride);
+      _packedPoints.resize (MC*d);
+      _tile.resize (MC*NC);
+      _best.resize (MC);
+      _nearest.resize (n);
+    }
+
+    void reserveCenters (size_t k)
+    {
+      size_t padded = roundUp (k, NR);
+      _centerNorms.reserve (padded);
+      _packedCenters.reserve (padded*_d);
+    }
+
+    /**
+     * the k centers of the dimension of the points, row major.  They
+     * are copied into NR wide column panels, each holding all _d
+     * dimensions of its centers.
+     */
+    void setCenters (const Scalar* c, size_t k)
+    {
+      _k = k;
+      size_t padded = roundUp (k, NR);
+      _centerNorms.assign (padded, std::numeric_limits<double>::infinity());
+      _packedCenters.assign (padded*_d, Scalar());
+      for (size_t j=0; j<k; j++)
+        {
+          const Scalar* x = c + j*_d;
+          _centerNorms[j] = squaredNorm (x);
+          Scalar* panel = &_packedCenters[(j/NR)*NR*_d];
+          for (size_t p=0; p<_d; p++)
+            panel[p*NR + j%NR] = x[p];
+        }
+    }
+
+    /**
+     * find the nearest center of every point.  Ties go to the lower
+     * center index, as in a linear scan.
+     */
+    void assign ()
+    {
+      if (_k == 0)
+        return;
+      for (size_t i0=0; i0<_n; i0+=MC)
+        assignBlock (i0, std::min ((size_t)MC, _n-i0));
+    }
+
+    uint32_t nearest (size_t i) const
+    {
+      return _nearest[i];
+    }
+
+  private:
+    const Scalar*          _points;
+    size_t                 _n;
+    size_t                 _d;
+    size_t                 _stride;
+    size_t                 _k;
+    std::vector<double>    _pointNorms;
+    std::vector<double>    _centerNorms;     // padded centers are at infinity
+    std::vector<Scalar>    _packedCenters;   // NR wide panels, p major
+    std::vector<Scalar>    _packedPoints;    // MR tall panels, p major
+    std::vector<Scalar>    _tile;            // MC x NC dot products
+    std::vector<double>    _best;
+    std::vector<uint32_t>  _nearest;
+
+    static size_t roundUp (size_t x, size_t m)
+    {
+      return (x + m-1) / m * m;
+    }
+
+    double squaredNorm (const Scalar* x) const
+    {
+      double norm = 0.0;
+      for (size_t p=0; p<_d; p++)
+        norm += (double)x[p]*x[p];
+      return norm;
+    }
+
+    void assignBlock (size_t i0, size_t mb)
+    {
+      packPoints (i0, mb);
+      std::fill (_best.begin(), _best.begin()+mb, std::numeric_limits<double>::infinity());
+
+      size_t padded = roundUp (_k, NR);
+      for (size_t j0=0; j0<padded; j0+=NC)
+        {
+          size_t nb = std::min ((size_t)NC, padded-j0);
+          std::fill (_tile.begin(), _tile.end(), Scalar());
+          for (size_t p0=0; p0<_d; p0+=KC)
+            {
+              size_t kc = std::min ((size_t)KC, _d-p0);
+              for (size_t ir=0; ir<mb; ir+=MR)
+                for (size_t jr=0; jr<nb; jr+=NR)
+                  microKernel (kc,
+                               &_packedPoints[ir*_d + p0*MR],
+                               &_packedCenters[(j0+jr)*_d + p0*NR],
+                               &_tile[ir*NC + jr]);
+            }
+
+          // epilogue: turn the dot products into distances and keep
+          // the nearest center of each point
+          for (size_t r=0; r<mb; r++)
+            {
+              const Scalar* dots = &_tile[r*NC];
+              double xnorm = _pointNorms[i0+r];
+              for (size_t j=0; j<nb; j++)
+                {
+                  double dist = xnorm - 2.0*dots[j] + _centerNorms[j0+j];
+                  if (dist < _best[r])
+                    {
+                      _best[r] = dist;
+                      _nearest[i0+r] = j0+j;
+                    }
+                }
+            }
+        }
+    }
+
+    // copy points [i0, i0+mb) into MR tall panels, zero padded
+    void packPoints (size_t i0, size_t mb)
+    {
+      for (size_t ir=0; ir<mb; ir+=MR)
+        {
+          Scalar* panel = &_packedPoints[ir*_d];
+          for (size_t r=0; r<MR; r++)
+            {
+              if (ir+r < mb)
+                {
+                  const Scalar* x = _points + (i0+ir+r)*_stride;
+                  for (size_t p=0; p<_d; p++)
+                    panel[p*MR + r] = x[p];
+                }
+              else
+                for (size_t p=0; p<_d; p++)
+                  panel[p*MR + r] = Scalar();
+            }
+        }
+    }
+
+    // c[MR x NR] (row stride NC) += a[kc x MR]^T b[kc x NR]
+    static void microKernel (size_t kc, const Scalar* a, const Scalar* b, Scalar* c)
+    {
+      vector_t acc[MR][NR/WIDTH];
+      for (size_t r=0; r<MR; r++)
+        for (size_t v=0; v<NR/WIDTH; v++)
+          acc[r][v] = vector_t();
+
+      for (size_t p=0; p<kc; p++)
+        {
+          const Scalar* ap = a + p*MR;
+          vector_t bp[NR/WIDTH];
+          memcpy (bp, b + p*NR, sizeof(bp));
+          for (size_t r=0; r<MR; r++)
+            for (size_t v=0; v<NR/WIDTH; v++)
+              acc[r][v] += ap[r] * bp[v];
+        }
+
+      for (size_t r=0; r<MR; r++)
+        {
+          Scalar sum[NR];
+          memcpy (sum, acc[r], sizeof(sum));
+          for (size_t v=0; v<NR; v++)
+            c[r*NC + v] += sum[v];
+        }
+    }
+  };
+
+}
+
+#endif  // CLUSTER_BLOCKEDDISTANCE_H_
@@ -0,0 +1,167 @@
+#ifndef CLUSTER_CENTROIDMODEL_H_
+#define CLUSTER_CENTROIDMODEL_H_
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <stdint.h>
+#include <boost/format.hpp>
+#include "KMeansCluster.h"
+#include "Metric.h"
+
+namespace kmcluster
+{
+  /**
+   * read the header line of a model file into k and d and return the
+   * metric it names
+   */
+  inline std::string readModelHeader (std::istream& in, const std::string& fname, size_t& k, size_t& d)
+  {
+    std::string line, metric;
+    std::getline (in, line);
+    std::istringstream header (line);
+    if (!(header >> k >> d >> metric))
+      throw (std::runtime_error ("not a model file: " + fname));
+    return metric;
+  }
+
+  /**
+   * the metric a model file was saved with, to pick the
+   * BasicCentroidModel to load it into
+   */
+  inline std::string modelMetric (const std::string& fname)
+  {
+    std::ifstream in (fname.c_str());
+    if (!in)
+      throw (std::runtime_error ("could not open model file: " + fname));
+    size_t k = 0, d = 0;
+    return readModelHeader (in, fname, k, d);
+  }
+
+  /**
+   * The centers of a finished clustering run, kept to assign new
+   * points to them.
+   *
+   * A model never changes once built, so any number of threads may
+   * query it at once; a retrained model is a new instance that
+   * replaces the old one, see clusterd.  The version tells the
+   * instances apart.
+   *
+   * The file format is text: a line "k d metric", then one center
+   * per line as d space separated coordinates.  The metric is the
+   * name of the Metric the centers were found and are served with; a
+   * model is only loaded into a BasicCentroidModel of that metric.
+   */
+  template <typename Metric = EuclideanMetric>
+  class BasicCentroidModel
+  {
+  public:
+    BasicCentroidModel (const std::vector<PointND>& centers, uint32_t version = 0)
+      : _k (centers.size())
+      , _d (centers.empty() ? 0 : centers[0].x.size())
+      , _version (version)
+      , _centers ()
+    {
+      _centers.reserve (_k*_d);
+      for (size_t c=0; c<_k; c++)
+        {
+          if (centers[c].x.size() != _d)
+            throw (std::runtime_error ((boost::format ("size mismatch: center of dimension %d in a model of dimension %d")
+                                        % centers[c].x.size() % _d).str()));
+          _centers.insert (_centers.end(), centers[c].x.begin(), centers[c].x.end());
+        }
+    }
+
+    static BasicCentroidModel load (const std::string& fname, uint32_t version = 0)
+    {
+      std::ifstream in (fname.c_str());
+      size_t k = 0, d = 0;
+      std::string metric = readModelHeader (in, fname, k, d);
+      if (metric != Metric::name())
+        throw (std::runtime_error ((boost::format ("%s holds a %s model, not a %s one")
+                                    % fname % metric % Metric::name()).str()));
+      std::vector<PointND> centers (k);
+      for (size_t c=0; c<k; c++)
+        {
+          centers[c].x.resize (d);
+          for (size_t j=0; j<d; j++)
+            if (!(in >> centers[c].x[j]))
+              throw (std::runtime_error ("truncated model file: " + fname));
+        }
+      return BasicCentroidModel (centers, version);
+    }
+
+    void save (const std::string& fname) const
+    {
+      std::ofstream out (fname.c_str());
+      out << _k << " " << _d << " " << Metric::name() << "\n";
+      for (size_t c=0; c<_k; c++)
+        {
+          for (size_t j=0; j<_d; j++)
+            out << boost::format ("%s%.17g") % (j > 0 ? " " : "") % _centers[c*_d + j];
+          out << "\n";
+        }
+      if (!out)
+        throw (std::runtime_error ("could not write model file: " + fname));
+    }
+
+    size_t size () const
+    {
+      return _k;
+    }
+
+    size_t dims () const
+    {
+      return _d;
+    }
+
+    uint32_t version () const
+    {
+      return _version;
+    }
+
+    /**
+     * the nearest center of the point x of dimension dims().  Ties go
+     * to the lower center index.
+     */
+    uint32_t nearest (const double* x) const
+    {
+      uint32_t closest = 0;
+      double   best    = Metric::compare (x, &_centers[0], _d);
+      for (size_t c=1; c<_k; c++)
+        {
+          double dist = Metric::compare (x, &_centers[c*_d], _d);
+          if (dist < best)
+            {
+              best    = dist;
+              closest = c;
+            }
+        }
+      return closest;
+    }
+
+    /**
+     * the nearest centers of n points, row major
+     */
+    void assign (const double* x, size_t n, uint32_t* out) const
+    {
+      if (_k == 0)
+        throw (std::runtime_error ("assignment against an empty model"));
+      for (size_t i=0; i<n; i++)
+        out[i] = nearest (x + i*_d);
+    }
+
+  private:
+    size_t               _k;
+    size_t               _d;
+    uint32_t             _version;
+    std::vector<double>  _centers;     // row major, one row per center
+  };
+
+  typedef BasicCentroidModel<> CentroidModel;
+
+}
+
+#endif  // CLUSTER_CENTROIDMODEL_H_
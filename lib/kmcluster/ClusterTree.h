@@ -0,0 +1,166 @@
+#ifndef CLUSTER_CLUSTERTREE_H_
+#define CLUSTER_CLUSTERTREE_H_
+
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+#include "Metric.h"
+
+namespace kmcluster
+{
+  /**
+   * The binary tree of splits made by bisecting k-means.
+   *
+   * Every node holds the center of the points below it, their mass
+   * and the sum of their costs, squared distances for k-means, to
+   * that center.  The points of
+   * a node are the range [begin, end) of the clusterer's point order,
+   * which the split partitions into the ranges of its two children.
+   * Leaves carry the id of their cluster.
+   *
+   * nearest() descends from the root, at each node following the
+   * child with the nearer center, so a query costs 2 log k distances
+   * instead of k.  It finds the exact nearest leaf center only as long
+   * as the tree splits the space the way the leaf centers do.
+   */
+  template <typename Scalar, typename Metric = EuclideanMetric>
+  class ClusterTree
+  {
+  public:
+    struct Node
+    {
+      int       parent;
+      int       child[2];
+      int       cluster;      // leaves only, -1 otherwise
+      bool      splittable;
+      size_t    begin;
+      size_t    end;
+      double    mass;
+      double    sse;
+    };
+
+    ClusterTree ()
+      : _d (0)
+      , _nodes ()
+      , _centers ()
+    { }
+
+    void clear (size_t d)
+    {
+      _d = d;
+      _nodes.clear ();
+      _centers.clear ();
+    }
+
+    /**
+     * add a leaf under parent (-1 for the root) and return its id
+     */
+    template <typename In>
+    int addNode (int parent, const In* center, size_t begin, size_t end, double mass, double sse)
+    {
+      Node n;
+      n.parent     = parent;
+      n.child[0]   = -1;
+      n.child[1]   = -1;
+      n.cluster    = -1;
+      n.splittable = end-begin >= 2 && sse > 0;
+      n.begin      = begin;
+      n.end        = end;
+      n.mass       = mass;
+      n.sse        = sse;
+      int id = _nodes.size();
+      _nodes.push_back (n);
+      _centers.insert (_centers.end(), center, center+_d);
+      if (parent >= 0)
+        {
+          Node& p = _nodes[parent];
+          p.child[p.child[0] < 0 ? 0 : 1] = id;
+        }
+      return id;
+    }
+
+    size_t size () const
+    {
+      return _nodes.size();
+    }
+
+    const Node& node (size_t i) const
+    {
+      return _nodes[i];
+    }
+
+    Node& node (size_t i)
+    {
+      return _nodes[i];
+    }
+
+    bool isLeaf (size_t i) const
+    {
+      return _nodes[i].child[0] < 0;
+    }
+
+    const Scalar* center (size_t i) const
+    {
+      return &_centers[i*_d];
+    }
+
+    Scalar* center (size_t i)
+    {
+      return &_centers[i*_d];
+    }
+
+    /**
+     * the ids of the leaves, in node order
+     */
+    std::vector<size_t> leaves () const
+    {
+      std::vector<size_t> ret;
+      for (size_t i=0; i<_nodes.size(); i++)
+        if (isLeaf (i))
+          ret.push_back (i);
+      return ret;
+    }
+
+    /**
+     * the cluster of the leaf reached by descending towards p
+     */
+    int nearest (const Scalar* p) const
+    {
+      if (_nodes.empty())
+        return -1;
+      size_t i = 0;
+      while (!isLeaf (i))
+        {
+          const Node& n = _nodes[i];
+          Scalar d0 = Metric::compare (p, center (n.child[0]), _d);
+          Scalar d1 = Metric::compare (p, center (n.child[1]), _d);
+          i = d1 < d0 ? n.child[1] : n.child[0];
+        }
+      return _nodes[i].cluster;
+    }
+
+    /**
+     * the depth of the deepest leaf, the root being at depth 0
+     */
+    size_t depth () const
+    {
+      size_t deepest = 0;
+      for (size_t i=0; i<_nodes.size(); i++)
+        {
+          size_t level = 0;
+          for (int p=_nodes[i].parent; p>=0; p=_nodes[p].parent)
+            level++;
+          deepest = std::max (deepest, level);
+        }
+      return deepest;
+    }
+
+  private:
+    size_t               _d;
+    std::vector<Node>    _nodes;
+    std::vector<Scalar>  _centers;     // row major, one row per node
+  };
+
+}
+
+#endif  // CLUSTER_CLUSTERTREE_H_
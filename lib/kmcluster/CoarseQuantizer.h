@@ -0,0 +1,220 @@
+#ifndef CLUSTER_COARSEQUANTIZER_H_
+#define CLUSTER_COARSEQUANTIZER_H_
+
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <utility>
+#include <stdint.h>
+#include "Metric.h"
+
+namespace kmcluster
+{
+  /**
+   * Approximate nearest center search over many centers, with an
+   * inverted file index.
+   *
+   * The centers are grouped into about sqrt(k) lists by a coarse
+   * quantizer: a few Lloyd passes of k-means over the centers
+   * themselves.  A query is compared with every list head, then only
+   * the centers of its nprobe nearest lists are scanned, so a query
+   * costs about (sqrt(k) + nprobe * sqrt(k)) distances instead of k.
+   * A point whose true nearest center sits in a list that was not
+   * probed gets the best center of the probed lists instead; raising
+   * nprobe trades speed for recall, and nprobe = number of lists is
+   * exact.
+   *
+   * Buffers are sized by reserve, after which build and nearest do
+   * not allocate.
+   */
+  template <typename Scalar, typename Metric = EuclideanMetric>
+  class CoarseQuantizer
+  {
+  public:
+    CoarseQuantizer ()
+      : _d (0)
+      , _k (0)
+      , _nLists (0)
+      , _nProbes (1)
+      , _heads ()
+      , _headSums ()
+      , _listOf ()
+      , _listStart ()
+      , _listFill ()
+      , _members ()
+      , _listCenters ()
+      , _headDist ()
+    { }
+
+    /**
+     * scan the nprobe nearest lists of each query
+     */
+    void setProbes (size_t nProbes)
+    {
+      _nProbes = std::max<size_t> (nProbes, 1);
+    }
+
+    size_t probes () const
+    {
+      return _nProbes;
+    }
+
+    size_t lists () const
+    {
+      return _nLists;
+    }
+
+    void reserve (size_t k, size_t d)
+    {
+      size_t nLists = listCount (k);
+      _heads.reserve (nLists*d);
+      _headSums.reserve (nLists*d);
+      _listOf.reserve (k);
+      _listStart.reserve (nLists+1);
+      _listFill.reserve (nLists);
+      _members.reserve (k);
+      _listCenters.reserve (k*d);
+      _headDist.reserve (nLists);
+    }
+
+    /**
+     * index k centers of dimension d, row major
+     */
+    void build (const Scalar* centers, size_t k, size_t d)
+    {
+      _k = k;
+      _d = d;
+      _nLists = listCount (k);
+      if (k == 0)
+        return;
+
+      // heads start at evenly spaced centers, then follow the centers
+      // assigned to them for a few passes
+      _heads.resize (_nLists*d);
+      for (size_t l=0; l<_nLists; l++)
+        std::copy (centers + (l*k/_nLists)*d, centers + (l*k/_nLists+1)*d, &_heads[l*d]);
+      _listOf.resize (k);
+      _listStart.assign (_nLists+1, 0);
+      for (size_t pass=0; pass<=LLOYD_PASSES; pass++)
+        {
+          for (size_t j=0; j<k; j++)
+            _listOf[j] = nearestHead (centers + j*d);
+          if (pass == LLOYD_PASSES)
+            break;
+          moveHeads (centers);
+        }
+
+      // lay out the centers of each list next to each other
+      std::fill (_listStart.begin(), _listStart.end(), 0);
+      for (size_t j=0; j<k; j++)
+        _listStart[_listOf[j]+1]++;
+      for (size_t l=0; l<_nLists; l++)
+        _listStart[l+1] += _listStart[l];
+      _members.resize (k);
+      _listCenters.resize (k*d);
+      _headDist.resize (_nLists);
+      _listFill.assign (_listStart.begin(), _listStart.end()-1);
+      for (size_t j=0; j<k; j++)
+        {
+          uint32_t slot = _listFill[_listOf[j]]++;
+          _members[slot] = j;
+          std::copy (centers + j*d, centers + (j+1)*d, &_listCenters[slot*d]);
+        }
+    }
+
+    /**
+     * the nearest center among the nprobe lists nearest to p.  Ties go
+     * to the lower center index, as in a linear scan.
+     */
+    size_t nearest (const Scalar* p)
+    {
+      size_t nProbes = std::min (_nProbes, _nLists);
+      for (size_t l=0; l<_nLists; l++)
+        _headDist[l] = std::make_pair (compare (p, &_heads[l*_d]), (uint32_t)l);
+      if (nProbes < _nLists)
+        std::nth_element (_headDist.begin(), _headDist.begin() + nProbes, _headDist.end());
+
+      Scalar   best    = std::numeric_limits<Scalar>::infinity();
+      uint32_t closest = 0;
+      for (size_t n=0; n<nProbes; n++)
+        {
+          uint32_t l = _headDist[n].second;
+          for (uint32_t s=_listStart[l]; s<_listStart[l+1]; s++)
+            {
+              Scalar dist = compare (p, &_listCenters[s*_d]);
+              if (dist < best || (dist == best && _members[s] < closest))
+                {
+                  best    = dist;
+                  closest = _members[s];
+                }
+            }
+        }
+      return closest;
+    }
+
+  private:
+    static const size_t LLOYD_PASSES = 2;
+
+    size_t                                  _d;
+    size_t                                  _k;
+    size_t                                  _nLists;
+    size_t                                  _nProbes;
+    std::vector<Scalar>                     _heads;         // row major, one row per list
+    std::vector<double>                     _headSums;
+    std::vector<uint32_t>                   _listOf;        // list of each center
+    std::vector<uint32_t>                   _listStart;     // CSR offsets into _members
+    std::vector<uint32_t>                   _listFill;      // next free slot of each list while building
+    std::vector<uint32_t>                   _members;       // center ids, grouped by list
+    std::vector<Scalar>                     _listCenters;   // center rows, in _members order
+    std::vector<std::pair<Scalar,uint32_t> > _headDist;
+
+    static size_t listCount (size_t k)
+    {
+      return std::max<size_t> (1, (size_t)std::ceil (std::sqrt ((double)k)));
+    }
+
+    Scalar compare (const Scalar* a, const Scalar* b) const
+    {
+      return Metric::compare (a, b, _d);
+    }
+
+    uint32_t nearestHead (const Scalar* x) const
+    {
+      uint32_t closest = 0;
+      Scalar   best    = compare (x, &_heads[0]);
+      for (size_t l=1; l<_nLists; l++)
+        {
+          Scalar dist = compare (x, &_heads[l*_d]);
+          if (dist < best)
+            {
+              best    = dist;
+              closest = l;
+            }
+        }
+      return closest;
+    }
+
+    // move each head to the mean of its centers; a head left without
+    // centers stays where it is
+    void moveHeads (const Scalar* centers)
+    {
+      _headSums.assign (_nLists*_d, 0.0);
+      std::fill (_listStart.begin(), _listStart.end(), 0);
+      for (size_t j=0; j<_k; j++)
+        {
+          double* sum = &_headSums[_listOf[j]*_d];
+          for (size_t p=0; p<_d; p++)
+            sum[p] += centers[j*_d + p];
+          _listStart[_listOf[j]]++;
+        }
+      for (size_t l=0; l<_nLists; l++)
+        if (_listStart[l] > 0)
+          for (size_t p=0; p<_d; p++)
+            _heads[l*_d + p] = _headSums[l*_d + p] / _listStart[l];
+    }
+  };
+
+}
+
+#endif  // CLUSTER_COARSEQUANTIZER_H_
@@ -0,0 +1,458 @@
+#ifndef CLUSTER_DELAUNAY_TRIANGULATION_H_
+#define CLUSTER_DELAUNAY_TRIANGULATION_H_
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <boost/format.hpp>
+#include "Triangle.h"
+
+namespace kmcluster
+{
+  /**
+   * Incremental (Bowyer-Watson) Delaunay triangulation of a set of
+   * 2D sites, used to answer nearest-site queries.
+   *
+   * A query locates the face containing the point by walking across
+   * faces using the barycentric coordinates of Triangle, then
+   * descends greedily along Delaunay edges.  Because the nearest site
+   * is always adjacent to any other site in the Delaunay graph whose
+   * Voronoi cell does not contain the query, the greedy descent ends
+   * on the true nearest site.  Coherent queries (consecutive points
+   * close together) start from the previous face, so most queries
+   * touch only a handful of faces.
+   */
+  class DelaunayTriangulation
+  {
+  public:
+    DelaunayTriangulation ()
+      : _sites()
+      , _alias()
+      , _faces()
+      , _triangles()
+      , _adjStart()
+      , _adj()
+      , _hull()
+      , _onHull()
+      , _hint(0)
+    { }
+
+    DelaunayTriangulation (const std::vector<bpoint2_t>& sites)
+      : _sites()
+      , _alias()
+      , _faces()
+      , _triangles()
+      , _adjStart()
+      , _adj()
+      , _hull()
+      , _onHull()
+      , _hint(0)
+    {
+      build (sites);
+    }
+
+    /**
+     * (re)build the triangulation for a new set of sites
+     */
+    void build (const std::vector<bpoint2_t>& sites)
+    {
+      size_t n = sites.size();
+      _sites = sites;
+      _alias.assign (n, -1);
+      _faces.clear ();
+      _triangles.clear ();
+      _hint = 0;
+      if (n == 0)
+        return;
+
+      addSuperTriangle ();
+
+      for (size_t i=0; i<n; i++)
+        insertSite (i);
+
+      finish ();
+    }
+
+    /**
+     * number of sites that were triangulated
+     */
+    size_t size () const
+    {
+      return _alias.size();
+    }
+
+    /**
+     * return the index of the site closest to point.  Ties between
+     * coincident sites resolve to the lowest index, as a linear scan
+     * would.
+     */
+    size_t nearest (const bpoint2_t& point) const
+    {
+      int v = startVertex (locate (point));
+      double dv = dist2 (v, point);
+
+      for (;;)
+        {
+          int    best  = v;
+          double dbest = dv;
+          for (int j=_adjStart[v]; j<_adjStart[v+1]; j++)
+            {
+              double d = dist2 (_adj[j], point);
+              if (d < dbest || (d == dbest && _adj[j] < best))
+                {
+                  dbest = d;
+                  best  = _adj[j];
+                }
+            }
+
+          // a vertex on the convex hull may be missing a hull edge to
+          // another hull vertex because the super triangle is finite,
+          // so give the other hull vertices a chance to improve on it
+          if (best == v && _onHull[v])
+            {
+              for (size_t j=0; j<_hull.size(); j++)
+                {
+                  double d = dist2 (_hull[j], point);
+                  if (d < dbest || (d == dbest && _hull[j] < best))
+                    {
+                      dbest = d;
+                      best  = _hull[j];
+                    }
+                }
+            }
+
+          if (best == v)
+            break;
+          v  = best;
+          dv = dbest;
+        }
+      return v;
+    }
+
+    std::string str () const
+    {
+      std::string out;
+      for (size_t i=0; i<_triangles.size(); i++)
+        out += _triangles[i].str() + "\n";
+      return out;
+    }
+
+  private:
+    static const int TRIAD_VERTICES = 3;
+
+    //
+    // private struct
+    //
+
+    // a face stores its vertices in counter clockwise order, and
+    // n[i] is the face across the edge opposite v[i] (-1 for none)
+    struct Face
+    {
+      int  v[TRIAD_VERTICES];
+      int  n[TRIAD_VERTICES];
+      bool alive;
+    };
+
+    std::vector<bpoint2_t> _sites;     // sites followed by the super triangle
+    std::vector<int>       _alias;     // site index, or the site it duplicates
+    std::vector<Face>      _faces;
+    std::vector<Triangle>  _triangles; // faces as barycentric Triangles
+    std::vector<int>       _adjStart;  // CSR offsets into _adj per site
+    std::vector<int>       _adj;       // Delaunay neighbors among the sites
+    std::vector<int>       _hull;      // sites adjacent to the super triangle
+    std::vector<bool>      _onHull;
+    mutable int            _hint;
+
+    static double X (const bpoint2_t& p) { return p.get<0>(); }
+    static double Y (const bpoint2_t& p) { return p.get<1>(); }
+
+    double dist2 (int v, const bpoint2_t& p) const
+    {
+      double dx = X(_sites[v]) - X(p);
+      double dy = Y(_sites[v]) - Y(p);
+      return dx*dx + dy*dy;
+    }
+
+    bool isSuper (int v) const
+    {
+      return v >= (int)_alias.size();
+    }
+
+    // > 0 when c lies to the left of the directed line a->b
+    static double orient (const bpoint2_t& a, const bpoint2_t& b, const bpoint2_t& c)
+    {
+      return (X(b)-X(a))*(Y(c)-Y(a)) - (Y(b)-Y(a))*(X(c)-X(a));
+    }
+
+    // true when p lies strictly inside the circumcircle of face f
+    bool inCircumcircle (const Face& f, const bpoint2_t& p) const
+    {
+      const bpoint2_t& a = _sites[f.v[0]];
+      const bpoint2_t& b = _sites[f.v[1]];
+      const bpoint2_t& c = _sites[f.v[2]];
+      double adx = X(a)-X(p), ady = Y(a)-Y(p);
+      double bdx = X(b)-X(p), bdy = Y(b)-Y(p);
+      double cdx = X(c)-X(p), cdy = Y(c)-Y(p);
+      double det = (adx*adx + ady*ady) * (bdx*cdy - cdx*bdy)
+                 - (bdx*bdx + bdy*bdy) * (adx*cdy - cdx*ady)
+                 + (cdx*cdx + cdy*cdy) * (adx*bdy - bdx*ady);
+      return det > 0;
+    }
+
+    void addSuperTriangle ()
+    {
+      double minx = X(_sites[0]), maxx = minx;
+      double miny = Y(_sites[0]), maxy = miny;
+      for (size_t i=1; i<_sites.size(); i++)
+        {
+          minx = std::min (minx, X(_sites[i]));
+          maxx = std::max (maxx, X(_sites[i]));
+          miny = std::min (miny, Y(_sites[i]));
+          maxy = std::max (maxy, Y(_sites[i]));
+        }
+      double cx = (minx+maxx)/2;
+      double cy = (miny+maxy)/2;
+      double m  = std::max (std::max (maxx-minx, maxy-miny), 1.0) * 64;
+
+      int s = _sites.size();
+      _sites.push_back (bpoint2_t (cx - 2*m, cy - m));
+      _sites.push_back (bpoint2_t (cx + 2*m, cy - m));
+      _sites.push_back (bpoint2_t (cx,       cy + 2*m));
+
+      Face f;
+      for (int i=0; i<TRIAD_VERTICES; i++)
+        {
+          f.v[i] = s+i;
+          f.n[i] = -1;
+        }
+      f.alive = true;
+      _faces.push_back (f);
+    }
+
+    // walk towards p from the hint using orientation tests
+    int walk (const bpoint2_t& p) const
+    {
+      int t = _hint;
+      if (t < 0 || t >= (int)_faces.size() || !_faces[t].alive)
+        for (t = _faces.size()-1; t > 0 && !_faces[t].alive; t--)
+          ;
+
+      for (size_t steps=0; steps<=_faces.size(); steps++)
+        {
+          const Face& f = _faces[t];
+          int next = -1;
+          for (int i=0; i<TRIAD_VERTICES && next < 0; i++)
+            {
+              const bpoint2_t& a = _sites[f.v[(i+1)%TRIAD_VERTICES]];
+              const bpoint2_t& b = _sites[f.v[(i+2)%TRIAD_VERTICES]];
+              if (orient (a, b, p) < 0)
+                next = f.n[i];
+            }
+          if (next < 0)
+            return t;
+          t = next;
+        }
+
+      // the walk can only cycle on degenerate input, fall back to a scan
+      for (size_t i=0; i<_faces.size(); i++)
+        {
+          if (!_faces[i].alive)
+            continue;
+          bool inside = true;
+          for (int j=0; j<TRIAD_VERTICES; j++)
+            if (orient (_sites[_faces[i].v[(j+1)%TRIAD_VERTICES]],
+                        _sites[_faces[i].v[(j+2)%TRIAD_VERTICES]], p) < 0)
+              inside = false;
+          if (inside)
+            return i;
+        }
+      return t;
+    }
+
+    void insertSite (size_t site)
+    {
+      const bpoint2_t& p = _sites[site];
+      int t0 = walk (p);
+
+      // coincident sites share a single vertex
+      for (int i=0; i<TRIAD_VERTICES; i++)
+        {
+          int v = _faces[t0].v[i];
+          if (X(_sites[v]) == X(p) && Y(_sites[v]) == Y(p))
+            {
+              _alias[site] = v;
+              return;
+            }
+        }
+      _alias[site] = site;
+
+      // grow the cavity of faces whose circumcircle contains p
+      struct Edge { int a, b, outer, newFace; };
+      std::vector<int>  bad (1, t0);
+      std::vector<Edge> boundary;
+      _faces[t0].alive = false;
+
+      for (size_t k=0; k<bad.size(); k++)
+        {
+          const Face& f = _faces[bad[k]];
+          for (int i=0; i<TRIAD_VERTICES; i++)
+            {
+              int nb = f.n[i];
+              if (nb >= 0 && !_faces[nb].alive)
+                continue;
+              if (nb >= 0 && inCircumcircle (_faces[nb], p))
+                {
+                  _faces[nb].alive = false;
+                  bad.push_back (nb);
+                  continue;
+                }
+              Edge e;
+              e.a       = f.v[(i+1)%TRIAD_VERTICES];
+              e.b       = f.v[(i+2)%TRIAD_VERTICES];
+              e.outer   = nb;
+              e.newFace = -1;
+              boundary.push_back (e);
+            }
+        }
+
+      // fan the cavity boundary around p
+      for (size_t k=0; k<boundary.size(); k++)
+        {
+          Edge& e = boundary[k];
+          Face f;
+          f.v[0]  = e.a;
+          f.v[1]  = e.b;
+          f.v[2]  = site;
+          f.n[0]  = -1;
+          f.n[1]  = -1;
+          f.n[2]  = e.outer;
+          f.alive = true;
+          e.newFace = _faces.size();
+          _faces.push_back (f);
+
+          if (e.outer >= 0)
+            {
+              Face& o = _faces[e.outer];
+              for (int i=0; i<TRIAD_VERTICES; i++)
+                if (o.n[i] >= 0 && !_faces[o.n[i]].alive)
+                  {
+                    // the outer face borders exactly one cavity face
+                    // along this edge, identified by its vertices
+                    int a = o.v[(i+1)%TRIAD_VERTICES];
+                    int b = o.v[(i+2)%TRIAD_VERTICES];
+                    if (a == e.b && b == e.a)
+                      o.n[i] = e.newFace;
+                  }
+            }
+        }
+
+      // link the new faces to each other around p
+      for (size_t k=0; k<boundary.size(); k++)
+        {
+          Face& f = _faces[boundary[k].newFace];
+          for (size_t j=0; j<boundary.size(); j++)
+            {
+              if (boundary[j].b == boundary[k].a)
+                f.n[1] = boundary[j].newFace;
+              if (boundary[j].a == boundary[k].b)
+                f.n[0] = boundary[j].newFace;
+            }
+        }
+
+      _hint = _faces.size()-1;
+    }
+
+    // compact the faces and derive the site adjacency used by queries
+    void finish ()
+    {
+      std::vector<int> remap (_faces.size(), -1);
+      std::vector<Face> live;
+      for (size_t i=0; i<_faces.size(); i++)
+        if (_faces[i].alive)
+          {
+            remap[i] = live.size();
+            live.push_back (_faces[i]);
+          }
+      for (size_t i=0; i<live.size(); i++)
+        for (int j=0; j<TRIAD_VERTICES; j++)
+          if (live[i].n[j] >= 0)
+            live[i].n[j] = remap[live[i].n[j]];
+      _faces.swap (live);
+      _hint = 0;
+
+      for (size_t i=0; i<_faces.size(); i++)
+        _triangles.push_back (Triangle (_sites[_faces[i].v[0]],
+                                        _sites[_faces[i].v[1]],
+                                        _sites[_faces[i].v[2]]));
+
+      size_t n = _alias.size();
+      std::vector<std::vector<int> > nbrs (n);
+      _onHull.assign (n, false);
+      _hull.clear ();
+      for (size_t i=0; i<_faces.size(); i++)
+        for (int j=0; j<TRIAD_VERTICES; j++)
+          {
+            int a = _faces[i].v[j];
+            int b = _faces[i].v[(j+1)%TRIAD_VERTICES];
+            if (isSuper (a) || isSuper (b))
+              {
+                if (!isSuper (a) && !_onHull[a])
+                  {
+                    _onHull[a] = true;
+                    _hull.push_back (a);
+                  }
+                continue;
+              }
+            nbrs[a].push_back (b);
+            nbrs[b].push_back (a);
+          }
+
+      _adjStart.assign (n+1, 0);
+      _adj.clear ();
+      for (size_t i=0; i<n; i++)
+        {
+          std::sort (nbrs[i].begin(), nbrs[i].end());
+          nbrs[i].erase (std::unique (nbrs[i].begin(), nbrs[i].end()), nbrs[i].end());
+          _adj.insert (_adj.end(), nbrs[i].begin(), nbrs[i].end());
+          _adjStart[i+1] = _adj.size();
+        }
+    }
+
+    // find the face containing point using barycentric coordinates,
+    // stepping across the edge opposite the most negative coordinate
+    int locate (const bpoint2_t& point) const
+    {
+      int t = _hint;
+      for (size_t steps=0; steps<=_faces.size(); steps++)
+        {
+          bpoint3_t bary = _triangles[t].getBarycentricCoordinates (point);
+          double lambda[TRIAD_VERTICES] = { bary.get<0>(), bary.get<1>(), bary.get<2>() };
+          int worst = std::min_element (lambda, lambda+TRIAD_VERTICES) - lambda;
+          if (lambda[worst] >= 0 || _faces[t].n[worst] < 0)
+            break;
+          t = _faces[t].n[worst];
+        }
+      _hint = t;
+      return t;
+    }
+
+    // the closest real site of a face, or any site for a face made
+    // only of super triangle vertices
+    int startVertex (int t) const
+    {
+      int v = -1;
+      for (int i=0; i<TRIAD_VERTICES; i++)
+        {
+          int u = _faces[t].v[i];
+          if (!isSuper (u) && _alias[u] == u)
+            v = u;
+        }
+      if (v < 0)
+        v = _hull.empty() ? 0 : _hull[0];
+      return v;
+    }
+  };
+
+}
+
+#endif  // CLUSTER_DELAUNAY_TRIANGULATION_H_
@@ -0,0 +1,64 @@
+#ifndef CLUSTER_DISTANCE_H_
+#define CLUSTER_DISTANCE_H_
+
+#include <cstddef>
+
+namespace kmcluster
+{
+  /**
+   * squared euclidean distance of two d dimensional rows, summed in T.
+   *
+   * The sum is split over eight independent partial sums, which the
+   * compiler turns into SIMD lanes without having to reassociate the
+   * sum, so it vectorizes without -ffast-math.
+   */
+  template <typename T>
+  inline T laneDistanceSquared (const T* a, const T* b, size_t d)
+  {
+    const size_t LANES = 8;
+    T lane[LANES] = { 0 };
+    size_t j = 0;
+    for (; j+LANES<=d; j+=LANES)
+      for (size_t l=0; l<LANES; l++)
+        {
+          T diff = a[j+l]-b[j+l];
+          lane[l] += diff*diff;
+        }
+    T dist = 0;
+    for (size_t l=0; l<LANES; l++)
+      dist += lane[l];
+    for (; j<d; j++)
+      {
+        T diff = a[j]-b[j];
+        dist += diff*diff;
+      }
+    return dist;
+  }
+
+  /**
+   * squared euclidean distance of two d dimensional rows, for comparing
+   * centers.  Float rows take the lanes above; double rows are summed
+   * in coordinate order, so double results round exactly as they did
+   * before float storage, ties included.
+   */
+  template <typename T>
+  inline T distanceSquared (const T* a, const T* b, size_t d)
+  {
+    return laneDistanceSquared (a, b, d);
+  }
+
+  template <>
+  inline double distanceSquared (const double* a, const double* b, size_t d)
+  {
+    double dist = 0;
+    for (size_t j=0; j<d; j++)
+      {
+        double diff = a[j]-b[j];
+        dist += diff*diff;
+      }
+    return dist;
+  }
+
+}
+
+#endif  // CLUSTER_DISTANCE_H_
@@ -0,0 +1,90 @@
+#ifndef CLUSTER_DUPLICATES_H_
+#define CLUSTER_DUPLICATES_H_
+
+#include <vector>
+#include <cstring>
+#include <stdint.h>
+
+namespace kmcluster
+{
+  // the bits of a coordinate, so duplicates are equal bit for bit:
+  // 0.0 and -0.0 differ and a NaN matches the same NaN
+  template <typename T>
+  inline uint64_t coordinateBits (T v)
+  {
+    uint64_t bits = 0;
+    memcpy (&bits, &v, sizeof(v) < sizeof(bits) ? sizeof(v) : sizeof(bits));
+    return bits;
+  }
+
+  // the splitmix64 finalizer, so nearby coordinates spread over the
+  // table
+  inline uint64_t mixBits (uint64_t h)
+  {
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+  }
+
+  /**
+   * Group the n points of dimension d of points into classes of exact
+   * duplicates, with an open addressing hash table over the bits of
+   * their coordinates.  first receives the first point of each class,
+   * in input order, and classOf the class of every point.  Points is
+   * anything with at (i, j) returning coordinate j of point i.
+   */
+  template <typename Points>
+  void findDuplicates (const Points& points, size_t n, size_t d,
+                       std::vector<uint32_t>& classOf, std::vector<uint32_t>& first)
+  {
+    static const uint32_t EMPTY = 0xffffffffu;
+
+    size_t slots = 16;
+    while (slots < 2*n)
+      slots *= 2;
+    std::vector<uint32_t> table (slots, EMPTY);
+    std::vector<uint64_t> classHash;
+    classOf.resize (n);
+    first.clear ();
+
+    for (size_t i=0; i<n; i++)
+      {
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for (size_t j=0; j<d; j++)
+          h = (h ^ coordinateBits (points.at (i, j))) * 0x100000001b3ULL;
+        h = mixBits (h);
+
+        size_t s = h & (slots-1);
+        for (;; s = (s+1) & (slots-1))
+          {
+            uint32_t c = table[s];
+            if (c == EMPTY)
+              {
+                c = first.size();
+                table[s] = c;
+                first.push_back (i);
+                classHash.push_back (h);
+                classOf[i] = c;
+                break;
+              }
+            if (classHash[c] != h)
+              continue;
+            size_t f = first[c];
+            size_t j = 0;
+            while (j < d && coordinateBits (points.at (i, j)) == coordinateBits (points.at (f, j)))
+              j++;
+            if (j == d)
+              {
+                classOf[i] = c;
+                break;
+              }
+          }
+      }
+  }
+
+}
+
+#endif  // CLUSTER_DUPLICATES_H_
@@ -9,9 +9,29 @@
 #include <cmath>
 #include <algorithm>
 #include <functional>
+#include <map>
+#include <cassert>
+#include <cstdlib>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <stdint.h>
+#include <thread>
 #include <boost/lexical_cast.hpp>
 #include <boost/format.hpp>
 #include <boost/bind.hpp>
+#include "Random.h"
+#include "PointArena.h"
+#include "PointView.h"
+#include "StringPool.h"
+#include "AllocationCounter.h"
+#include "Metric.h"
+#include "BlockedDistance.h"
+#include "CoarseQuantizer.h"
+#include "ClusterTree.h"
+#include "Profiler.h"
+#include "SpaceFillingCurve.h"
+#include "Duplicates.h"
 
 using namespace std;
 
@@ -93,63 +113,695 @@ namespace kmcluster
 
     PointND& operator/=(double v)
     {
-      std::transform (x.begin(), x.end(), x.begin(), boost::bind(std::divides<double>(),_1,v));
+      for (size_t i=0; i<x.size(); i++)
+        x[i] /= v;
       return *this;
     }
   };
 
-  class KMeansClusterND
+  /**
+   * the order the clustering loop visits points in, see
+   * setPointOrder
+   */
+  enum PointOrder
+  {
+    INPUT_ORDER,
+    MORTON_ORDER,
+    HILBERT_ORDER,
+    ASSIGNMENT_ORDER
+  };
+
+  /**
+   * KMeans++ clustering of dense points stored as Scalar.
+   *
+   * With Scalar = float, points and centers take half the memory and
+   * bandwidth of double and the distance comparisons of the assignment
+   * loop run in float, while centroid sums, seeding weights, inertia
+   * and spread are still accumulated in double.
+   *
+   * Metric is a distance policy from Metric.h; the default is plain
+   * k-means.
+   */
+  template <typename Scalar, typename Metric = EuclideanMetric>
+  class BasicKMeansClusterND
   {
   public:
-    KMeansClusterND (size_t nClusters)
-      : _data()
-      , _clusters()
+    typedef Metric metric_type;
+
+    BasicKMeansClusterND (size_t nClusters)
+      : _points()
+      , _labels()
+      , _data()
+      , _centers()
+      , _centerLabels()
+      , _sums()
+      , _clusterMass()
       , _nClusters (nClusters)
+      , _iterations (0)
+      , _maxIterations (0)
+      , _random ()
+      , _threads (1)
+      , _chunkWeight ()
+      , _checkpointFile ()
+      , _checkpointEvery (0)
+      , _loopAllocations (0)
+      , _useBlocked (false)
+      , _blocked ()
+      , _useApproximate (false)
+      , _ivf ()
+      , _tree ()
+      , _order ()
+      , _medianOrder ()
+      , _medianStart ()
+      , _medianValues ()
+      , _profiler (0)
+      , _pointOrder (INPUT_ORDER)
+      , _inputIndex ()
+      , _position ()
+      , _uniqueOf ()
+      , _rowLabels ()
     { }
 
-    void add (const PointND& p)
+    /**
+     * cluster the points of a view of caller memory.  Points whose
+     * coordinates are adjacent, row major or interleaved, are read in
+     * place and never copied; the view must then outlive the
+     * clusterer.  Columnar points are gathered into the arena once,
+     * since every distance kernel reads a point as one row.  Viewed
+     * points have empty labels and mass 1, and no more points can be
+     * added.
+     */
+    BasicKMeansClusterND (const BasicPointView<Scalar>& points, size_t nClusters)
+      : BasicKMeansClusterND (nClusters)
+    {
+      uint32_t label = _labels.intern ("");
+      if (points.rowContiguous ())
+        _points.view (points.data, points.n, points.d, points.stride);
+      else
+        {
+          std::vector<Scalar> x (points.d);
+          _points.reserve (points.n);
+          for (size_t i=0; i<points.n; i++)
+            {
+              for (size_t j=0; j<points.d; j++)
+                x[j] = points.at (i, j);
+              _points.add (x.data(), points.d);
+            }
+        }
+      _data.assign (points.n, PointData (label));
+    }
+
+    /**
+     * add a point, mass is the number of points it stands for.  Seeding
+     * and centroids treat a point of mass m as m copies of it.
+     *
+     * The coordinates are copied into the point arena and the label
+     * is interned, nothing else is kept of the PointND.
+     */
+    void add (const PointND& p, double mass = 1.0)
     {
-      _data.push_back (p);
+      uint32_t n = _data.size();
+      _points.add (p.x.data(), p.x.size());
+      _data.push_back (PointData (_labels.intern (p.label), mass));
+      // points added after reordering or deduplicating go at the end
+      if (!_inputIndex.empty())
+        {
+          _inputIndex.push_back (n);
+          _position.push_back (n);
+        }
+      if (!_uniqueOf.empty())
+        {
+          _uniqueOf.push_back (n);
+          _rowLabels.push_back (_data.back().label);
+        }
+    }
+
+    /**
+     * reserve arena space for nPoints points of the dimension of the
+     * points already added (or of the first one added)
+     */
+    void reserve (size_t nPoints)
+    {
+      _points.reserve (nPoints);
+      _data.reserve (nPoints);
+    }
+
+    /**
+     * the number of points clustered, which after deduplicate is the
+     * number of distinct points
+     */
+    size_t size () const
+    {
+      return _data.size();
+    }
+
+    /**
+     * Merge exact duplicates, points equal in every coordinate, into one
+     * point whose mass is the sum of theirs, and return the number of
+     * distinct points.  Call it after adding the points, before
+     * clustering.
+     *
+     * Seeding, assignment, centroids, inertia and spread all weigh a
+     * point by its mass, so the clustering solves the same weighted
+     * problem as on the full input while every pass costs distinct
+     * points rather than input points.  Seeding draws from the same
+     * distribution, but a draw lands on the merged point where the
+     * full run would have walked through its copies one by one, so a
+     * given seed picks other centers than without deduplication, and
+     * centroid sums round differently.
+     *
+     * assignments and clusterSets still list every added point, with
+     * its own label.
+     */
+    size_t deduplicate ()
+    {
+      if (!_inputIndex.empty())
+        throw (std::runtime_error ("deduplicate the points before they are reordered"));
+
+      std::vector<uint32_t> classOf, first;
+      findDuplicates (_points, _data.size(), _points.dims(), classOf, first);
+
+      // every added point keeps its label and learns its distinct point
+      std::vector<uint32_t> rowLabels (inputCount());
+      for (size_t r=0; r<rowLabels.size(); r++)
+        rowLabels[r] = inputLabel (r);
+      _rowLabels.swap (rowLabels);
+      if (_uniqueOf.empty())
+        _uniqueOf = classOf;
+      else
+        for (size_t r=0; r<_uniqueOf.size(); r++)
+          _uniqueOf[r] = classOf[_uniqueOf[r]];
+
+      std::vector<PointData> data (first.size());
+      for (size_t c=0; c<first.size(); c++)
+        {
+          data[c] = _data[first[c]];
+          data[c].mass = 0.0;
+        }
+      for (size_t i=0; i<_data.size(); i++)
+        data[classOf[i]].mass += _data[i].mass;
+      _data.swap (data);
+      _points.gather (first);
+      return _data.size();
     }
 
     std::vector<PointND> cluster () 
     {
+      clearCenters ();
+      _iterations = 0;
+
       // select initial seeds for clusters
-      for (size_t i=0; i<_nClusters; i++)
+      {
+        ProfileScope scope (_profiler, "seed");
+        for (size_t i=0; i<_nClusters; i++)
+          {
+            //std::cerr << "+";
+            weightDataPoints ();
+            selectClusterCenter ();
+          }
+      }
+      //std::cerr << "done initializing\n";
+      return KMeansCluster ();
+    }
+
+    /**
+     * Bisecting k-means.  Starting from one cluster holding every
+     * point, repeatedly split the leaf with the largest sum of squared
+     * distances in two with 2-means, until there are nClusters leaves
+     * or no leaf can be split.  Every level of the tree reads each
+     * point a few times, so the run costs O(n log k) distances rather
+     * than the O(nk) of each flat iteration.
+     *
+     * Leaves never share points, so with setThreads each round splits
+     * the nThreads largest leaves at once.  The tree then depends on
+     * the thread count as well as on the seed.
+     *
+     * Up to refinePasses flat Lloyd iterations, started from the leaf
+     * centers, follow.  They move the leaf centers of the tree along
+     * but not its inner nodes, see treeNearest.
+     */
+    std::vector<PointND> clusterBisecting (int refinePasses = 0)
+    {
+      size_t n = _data.size();
+      clearCenters ();
+      _iterations = 0;
+      _tree.clear (_points.dims());
+      if (n == 0)
+        return centers ();
+
+      _order.resize (n);
+      for (size_t i=0; i<n; i++)
+        _order[i] = i;
+      SplitHalf root;
+      measureRange (0, n, root);
+      _tree.addNode (-1, root.center.data(), 0, n, root.mass, root.sse);
+
+      {
+        ProfileScope scope (_profiler, "split");
+        splitLeaves ();
+      }
+
+      // the leaves become the clusters, in node order
+      std::vector<size_t> leaves = _tree.leaves ();
+      for (size_t c=0; c<leaves.size(); c++)
         {
-          //std::cerr << "+";
-          weightDataPoints ();
-          selectClusterCenter ();
+          typename ClusterTree<Scalar,Metric>::Node& leaf = _tree.node (leaves[c]);
+          leaf.cluster = c;
+          addCenter (_tree.center (leaves[c]), 0);
+          for (size_t j=leaf.begin; j<leaf.end; j++)
+            _data[_order[j]].clusterid = c;
         }
-      //std::cerr << "done initializing\n";
+
+      if (refinePasses > 0)
+        {
+          prepareLoop ();
+          for (int pass=0; pass<refinePasses; pass++)
+            {
+              bool changed = false;
+              uint64_t allocations = heapAllocations ();
+              assignAndUpdate (changed);
+              _loopAllocations += heapAllocations () - allocations;
+              if (!changed)
+                break;
+            }
+          for (size_t c=0; c<leaves.size(); c++)
+            std::copy (getCenterRow (c), getCenterRow (c) + _points.dims(), _tree.center (leaves[c]));
+        }
+      return centers ();
+    }
+
+    /**
+     * the cluster of p found by descending the tree of the last
+     * clusterBisecting run, comparing p with the two children of each
+     * node: 2 log k distances instead of k.  After refinement passes
+     * the descent can end in a leaf other than the nearest center.
+     */
+    int treeNearest (const PointND& p) const
+    {
+      std::vector<Scalar> x (p.x.begin(), p.x.end());
+      return _tree.nearest (x.data());
+    }
+
+    const ClusterTree<Scalar,Metric>& tree () const
+    {
+      return _tree;
+    }
+
+    /**
+     * stop iterating after n iterations even if points still move,
+     * with a warning; 0, the default, iterates until no point moves
+     */
+    void setMaxIterations (int n)
+    {
+      _maxIterations = n;
+    }
+
+    /**
+     * reseed the random stream used for seeding and sampling.  Each
+     * instance has its own stream, so runs with the same seed and
+     * thread count pick the same points.
+     */
+    void setSeed (uint64_t seed)
+    {
+      _random.seed (seed);
+    }
+
+    /**
+     * split seeding and coreset sampling over nThreads threads, each
+     * working on a contiguous chunk of the points
+     */
+    void setThreads (size_t nThreads)
+    {
+      _threads = nThreads > 0 ? nThreads : 1;
+    }
+
+    /**
+     * record the time and hardware counters of the phases of each run,
+     * seed, assign, update, split, sample and checkpoint, in profiler.
+     * The profiler is not owned and must outlive the runs; null turns
+     * profiling off.
+     */
+    void setProfiler (Profiler* profiler)
+    {
+      _profiler = profiler;
+    }
+
+    /**
+     * Reorder the points before the clustering loop of cluster and
+     * resume, so that points of the same cluster sit together in
+     * memory: consecutive points then read the same centers and mostly
+     * pick the same one, which keeps the centers in cache and the
+     * comparisons of the nearest center search predictable.
+     *
+     * MORTON_ORDER and HILBERT_ORDER sort the points along a space
+     * filling curve, see SpaceFillingCurve.h; ASSIGNMENT_ORDER groups
+     * them by their current cluster, or by their nearest center after
+     * seeding.  The reordering happens after seeding, so it picks the
+     * same seeds as INPUT_ORDER.  Centroid sums then add up in another
+     * order and can round differently.
+     *
+     * Points are moved, a view of caller memory is copied into the
+     * arena.  assignments, clusterSets and checkpoints stay in the
+     * order the points were added, see inputIndex.
+     */
+    void setPointOrder (PointOrder order)
+    {
+      _pointOrder = order;
+    }
+
+    /**
+     * the index, in the order they were added, of the point now at
+     * position i.  After deduplicate it counts distinct points, in the
+     * order of their first copy.
+     */
+    size_t inputIndex (size_t i) const
+    {
+      return _inputIndex.empty() ? i : _inputIndex[i];
+    }
+
+    /**
+     * find nearest centers with the blocked matrix multiply engine of
+     * BlockedDistance rather than one distance at a time.  It pays off
+     * for high dimensional points and many centers; the expanded
+     * distance rounds differently, so near ties can go the other way.
+     * Only for metrics whose nearest center is the euclidean one.
+     */
+    void setBlockedDistances (bool blocked)
+    {
+      if (blocked && !Metric::EUCLIDEAN_MONOTONE)
+        throw (std::runtime_error ("blocked distances need a metric that is monotone in the euclidean distance"));
+      _useBlocked = blocked;
+    }
+
+    /**
+     * find nearest centers approximately, with an inverted file index
+     * over the centers that is rebuilt every iteration, see
+     * CoarseQuantizer.  Each point scans the centers of the nProbes
+     * lists nearest to it; more probes give fewer wrong assignments
+     * and slower iterations.  Zero probes turns it off again.  Takes
+     * precedence over setBlockedDistances.
+     */
+    void setApproximateSearch (size_t nProbes)
+    {
+      _useApproximate = nProbes > 0;
+      _ivf.setProbes (nProbes);
+    }
+
+    /**
+     * the number of points whose approximate nearest center for the
+     * current centers differs from the exact one.  This is a full
+     * exact assignment, so it costs as much as an iteration without
+     * the index.
+     */
+    size_t approximateFlips ()
+    {
+      if (centerCount() == 0)
+        return 0;
+      _ivf.build (_centers.data(), centerCount(), _points.dims());
+      size_t flips = 0;
+      for (size_t i=0; i<_data.size(); i++)
+        if (_ivf.nearest (_points.row (i)) != getNearestCluster (_points.row (i)))
+          flips++;
+      return flips;
+    }
+
+    /**
+     * write a checkpoint to fname after every `every` iterations of
+     * the clustering loop.  The file is written under a temporary name
+     * and renamed into place, so a job killed while writing it leaves
+     * the previous checkpoint intact.
+     */
+    void setCheckpoint (const std::string& fname, int every = 1)
+    {
+      _checkpointFile  = fname;
+      _checkpointEvery = every;
+    }
+
+    /**
+     * continue clustering from a checkpoint written by an earlier run
+     * over the same points.  The centers, assignments, iteration count
+     * and random state are restored, so the run carries on along the
+     * same trajectory without seeding or repeating iterations.
+     */
+    std::vector<PointND> resume (const std::string& fname)
+    {
+      readCheckpoint (fname);
       return KMeansCluster ();
     }
 
+    std::vector<PointND> centers () const
+    {
+      std::vector<PointND> ret;
+      for (size_t c=0; c<centerCount(); c++)
+        ret.push_back (getCenter (c));
+      return ret;
+    }
+
+    /**
+     * assign every point to the nearest of the given centers without
+     * iterating, e.g. to label the full data set with centers found on
+     * a coreset of it.
+     */
+    void assign (const std::vector<PointND>& centers)
+    {
+      if (centers.empty() && !_data.empty())
+        throw (std::runtime_error ("no centers to assign points to"));
+      for (size_t c=0; c<centers.size(); c++)
+        if (centers[c].x.size() != _points.dims())
+          throw (std::runtime_error ((boost::format ("center %d has %d dimensions, have points of dimension %d")
+                                      % c % centers[c].x.size() % _points.dims()).str()));
+      clearCenters ();
+      for (size_t c=0; c<centers.size(); c++)
+        addCenter (centers[c].x.data(), _labels.intern (centers[c].label));
+      ProfileScope scope (_profiler, "assign");
+      prepareLoop ();
+      findNearest ();
+      for (size_t i=0; i<_data.size(); i++)
+        _data[i].clusterid = nearestCluster (i);
+    }
+
+    /**
+     * Build a coreset: a small weighted sample whose clustering cost
+     * approximates that of the full data for every set of k centers.
+     *
+     * This is sensitivity sampling (Feldman & Langberg, Lucic et al.)
+     * on top of a k-means++ seeding.  The seeding is a bicriteria
+     * solution B with cost phi; a point x in the part B_x is sampled
+     * with probability proportional to its sensitivity
+     *
+     *   s(x) = a d(x,B)^2/phi' + 2a phi(B_x)/(|B_x| phi') + 4|P|/|B_x|
+     *
+     * where a = 16(ln k + 2) and phi' = phi/|P|, and is added to summary
+     * with weight 1/(nSamples p(x)).  Repeated draws of a point are
+     * merged.  The return value is the error scale of the sample
+     * size, see coresetErrorScale; it is no epsilon.
+     */
+    double coreset (size_t nSamples, BasicKMeansClusterND& summary, double delta = 0.05)
+    {
+      if (_data.empty() || nSamples == 0)
+        return 0.0;
+
+      clearCenters ();
+      {
+        ProfileScope scope (_profiler, "seed");
+        for (size_t i=0; i<_nClusters; i++)
+          {
+            weightDataPoints ();
+            selectClusterCenter ();
+          }
+      }
+
+      ProfileScope scope (_profiler, "sample");
+      size_t k = centerCount();
+      std::vector<double> partCost (k, 0.0);
+      std::vector<double> partMass (k, 0.0);
+      std::vector<double> cost2 (_data.size());
+      double totalCost = 0.0;
+      double totalMass = 0.0;
+      for (size_t i=0; i<_data.size(); i++)
+        {
+          size_t c = getNearestCluster (_points.row (i));
+          cost2[i] = Metric::cost (_points.row (i), getCenterRow (c), _points.dims());
+          _data[i].clusterid = c;
+          partCost[c] += _data[i].mass * cost2[i];
+          partMass[c] += _data[i].mass;
+          totalCost   += _data[i].mass * cost2[i];
+          totalMass   += _data[i].mass;
+        }
+
+      double alpha = 16 * (log ((double)k) + 2);
+      double meanCost = totalCost > 0 ? totalCost/totalMass : 1.0;
+      std::vector<double> cumulative (_data.size());
+      double running = 0.0;
+      for (size_t i=0; i<_data.size(); i++)
+        {
+          size_t c = _data[i].clusterid;
+          double sensitivity = alpha*cost2[i]/meanCost
+                             + 2*alpha*partCost[c]/(partMass[c]*meanCost)
+                             + 4*totalMass/partMass[c];
+          _data[i].weight = sensitivity;
+          running += _data[i].mass * sensitivity;
+          cumulative[i] = running;
+        }
+
+      // every chunk draws its share of the samples from its own split
+      // of the random stream, and the picks are merged in chunk order
+      size_t nChunks = chunkCount ();
+      std::vector<RandomStream> streams;
+      for (size_t t=0; t<nChunks; t++)
+        streams.push_back (_random.split (t));
+      std::vector<std::map<size_t,double> > picks (nChunks);
+      SampleChunk sampler = { &cumulative, nSamples, &streams, &picks };
+      runChunks (nChunks, boost::bind (&BasicKMeansClusterND::sampleChunk, this, boost::cref (sampler), _1, _2, _3));
+
+      std::map<size_t,double> picked;
+      for (size_t t=0; t<nChunks; t++)
+        for (std::map<size_t,double>::const_iterator i = picks[t].begin(); i != picks[t].end(); ++i)
+          picked[i->first] += i->second;
+
+      for (std::map<size_t,double>::const_iterator i = picked.begin(); i != picked.end(); ++i)
+        summary.add (getPoint (i->first), i->second);
+
+      // leave this instance ready to cluster from scratch
+      clearCenters ();
+      for (size_t i=0; i<_data.size(); i++)
+        _data[i].clusterid = -1;
+
+      return coresetErrorScale (nSamples, k, _points.dims(), delta);
+    }
+
+    /**
+     * The sample bound m = O(S^2/eps^2 (dk log k + log 1/delta)) for a
+     * total sensitivity S = 3a + 4k, solved for eps with the unknown
+     * constant of the O() left out.  The bound is loose and its
+     * constant is unknown, so the value is far above 1 for practical
+     * sample sizes and is not an error bound.  It is only a relative
+     * heuristic: it scales as 1/sqrt(nSamples), so comparing it across
+     * sample sizes, k and d shows how the guarantee moves.
+     */
+    static double coresetErrorScale (size_t nSamples, size_t k, size_t d, double delta)
+    {
+      double alpha = 16 * (log ((double)k) + 2);
+      double totalSensitivity = 3*alpha + 4*k;
+      double dimension = d*k*log ((double)k+1) + log (1/delta);
+      return totalSensitivity * sqrt (dimension/nSamples);
+    }
+
+    /**
+     * Heap allocations made inside the clustering loop, summed over
+     * all iterations.  Assignment and the centroid update work in
+     * place on the arena and the preallocated center arrays, so this
+     * stays at zero; see AllocationCounter.h for how to enable the
+     * counting.
+     */
+    uint64_t loopAllocations () const
+    {
+      return _loopAllocations;
+    }
+
+    /**
+     * number of blocks allocated by the point arena while loading
+     */
+    uint64_t arenaAllocations () const
+    {
+      return _points.allocations();
+    }
+
+    /**
+     * number of distinct labels, including the empty label
+     */
+    size_t labelCount () const
+    {
+      return _labels.size();
+    }
+
+    /**
+     * the cluster of every point, in the order they were added, with
+     * an entry for each duplicate merged by deduplicate
+     */
+    std::vector<int> assignments () const
+    {
+      std::vector<int> ret (inputCount());
+      for (size_t r=0; r<ret.size(); r++)
+        ret[r] = _data[inputPosition (r)].clusterid;
+      return ret;
+    }
+
+    /**
+     * mass weighted sum of the costs of the points, squared distances
+     * to their centers for k-means, accumulated in double
+     */
+    double inertia () const
+    {
+      double total = 0.0;
+      for (size_t i=0; i<_data.size(); i++)
+        if (_data[i].clusterid >= 0)
+          total += _data[i].mass * Metric::cost (_points.row (i),
+                                                 getCenterRow (_data[i].clusterid),
+                                                 _points.dims());
+      return total;
+    }
+
+    /**
+     * the number of points whose nearest center, compared in Scalar,
+     * differs from the nearest center compared in double.  Always zero
+     * for double storage.
+     */
+    size_t comparisonFlips () const
+    {
+      size_t flips = 0;
+      for (size_t i=0; i<_data.size() && centerCount() > 0; i++)
+        {
+          size_t closest  = 0;
+          double distance = Metric::cost (getCenterRow (0), _points.row (i), _points.dims());
+          for (size_t c=1; c<centerCount(); c++)
+            {
+              double d = Metric::cost (getCenterRow (c), _points.row (i), _points.dims());
+              if (d < distance)
+                {
+                  distance = d;
+                  closest  = c;
+                }
+            }
+          if (closest != getNearestCluster (_points.row (i)))
+            flips++;
+        }
+      return flips;
+    }
+
     std::string str() const
     {
       std::string out;
-      for (size_t i=0; i<_clusters.size(); i++)
-        out += _clusters[i].str();
+      for (size_t c=0; c<centerCount(); c++)
+        out += getCenter (c).str() + "\n";
       return out;
     }
 
     std::string clusterSets () const
     {
       std::vector<std::string> clusterStrings(_nClusters);
+      std::vector<double>      spread = spreads ();
 
       double totalSpread = 0.0;
-      for (size_t i=0; i<_clusters.size(); i++)
+      for (size_t i=0; i<centerCount(); i++)
         {
-          totalSpread += _clusters[i].spread();
-          clusterStrings[i] = (boost::format("cluster %d spread %f\n") % i % _clusters[i].spread()).str();
+          totalSpread += spread[i];
+          clusterStrings[i] = (boost::format("cluster %d spread %f\n") % i % spread[i]).str();
         }
       cout << "total spread: " << totalSpread << endl;
       
-      for (size_t i=0; i<_data.size(); i++)
+      // points are listed under the cluster the run assigned them to,
+      // which the spreads are measured over too: after an unrefined
+      // bisection, an approximate search or a capped run that need not
+      // be the nearest center
+      for (size_t r=0; r<inputCount(); r++)
         {
-          PointND p = _data[i].point;
-          size_t c = getNearestCluster (p);
-          clusterStrings[c] += p.str () + "\n";
+          size_t i = inputPosition (r);
+          if (_data[i].clusterid < 0)
+            continue;
+          const Scalar* x = _points.row (i);
+          PointND p (_labels.str (inputLabel (r)), std::vector<double> (x, x+_points.dims()));
+          clusterStrings[_data[i].clusterid] += p.str () + "\n";
         }
 
       std::string ret;
@@ -162,195 +814,663 @@ namespace kmcluster
 
   private:
 
-    void weightDataPoints ()
-    {
-      size_t newestClusterIndex = _clusters.size()-1;
-      for (size_t i=0; i<_data.size(); i++)
-        {
-          if (_clusters.size() == 0)
-            {
-              _data[i].weight = 1;
-            }
-          else
-            {
-              //cout << _data[i].point.str() << endl;
-              double dmetric = _data[i].point.distance (_clusters[newestClusterIndex].getCenter());
-              if (_data[i].weight > dmetric)
-                _data[i].weight = dmetric;
-            }
-        }
-    }
-
     //
     // private struct
     //
-    
+
+    // weight is the seeding weight, the distance to the nearest
+    // center chosen so far, while mass is the fixed number of input
+    // points the point stands for.  The coordinates of point i are
+    // row i of the arena.
     struct PointData
     {
-      PointND   point;
+      uint32_t  label;
       int       clusterid;
       double    weight;
+      double    mass;
 
-      PointData (const PointND& p)
-        : point(p)
+      PointData (uint32_t l, double m = 1.0)
+        : label(l)
         , clusterid(-1)
         , weight (0.0)
+        , mass (m)
       { }
 
       PointData ()
-        : point()
+        : label(0)
         , clusterid(-1)
         , weight (0.0)
+        , mass (1.0)
       { }
+    };
 
-      std::string str() const
-      {
-        return (boost::format("%s %d %.3f\n") 
-                % point.str()
-                % clusterid
-                % weight).str();
-      }
-      
+    // the center, mass and sum of squared distances of one side of a
+    // split, kept in double
+    struct SplitHalf
+    {
+      std::vector<double>  center;
+      double               mass;
+      double               sse;
+    };
+
+    // a split of one tree node, made by one thread.  The points of the
+    // node end up partitioned as [begin, mid) and [mid, end).
+    struct Split
+    {
+      size_t        node;
+      RandomStream  random;
+      bool          ok;
+      size_t        mid;
+      SplitHalf     half[2];
+    };
+
+    struct SampleChunk
+    {
+      const std::vector<double>*               cumulative;
+      size_t                                   nSamples;
+      std::vector<RandomStream>*               streams;
+      std::vector<std::map<size_t,double> >*   picks;
     };
 
     //
-    // private class
+    // private data
     //
 
-    class Cluster
+    BasicPointArena<Scalar>                 _points;
+    StringPool                              _labels;
+    std::vector<PointData>                  _data;
+    std::vector<Scalar>                     _centers;         // row major, one row per center
+    std::vector<uint32_t>                   _centerLabels;
+    std::vector<double>                     _sums;            // mass weighted sums, like _centers
+    std::vector<double>                     _clusterMass;
+    size_t                                  _nClusters;
+    int                                     _iterations;
+    int                                     _maxIterations;   // 0 for no limit
+    RandomStream                            _random;
+    size_t                                  _threads;
+    std::vector<double>                     _chunkWeight;     // seeding weight per chunk
+    std::string                             _checkpointFile;
+    int                                     _checkpointEvery;
+    uint64_t                                _loopAllocations;
+    bool                                    _useBlocked;
+    BlockedDistance<Scalar>                 _blocked;
+    bool                                    _useApproximate;
+    CoarseQuantizer<Scalar,Metric>          _ivf;
+    ClusterTree<Scalar,Metric>              _tree;
+    std::vector<uint32_t>                   _order;           // point order of the tree's ranges
+    std::vector<uint32_t>                   _medianOrder;     // point ids grouped by cluster
+    std::vector<size_t>                     _medianStart;
+    std::vector<std::pair<Scalar,double> >  _medianValues;
+    Profiler*                               _profiler;        // not owned, may be null
+    PointOrder                              _pointOrder;
+    std::vector<uint32_t>                   _inputIndex;      // input index of each position, empty for input order
+    std::vector<uint32_t>                   _position;        // position of each input index
+    std::vector<uint32_t>                   _uniqueOf;        // distinct point of each added point, empty if not deduplicated
+    std::vector<uint32_t>                   _rowLabels;       // label of each added point, likewise
+
+    //
+    // points and centers
+    //
+
+    // in Scalar, used to compare centers
+    static Scalar distanceSquared (const Scalar* a, const Scalar* b, size_t d)
     {
-    public:
-      Cluster (const PointND& p)
-      {
-        _points.insert (p);
-        _center = p;
-      }
+      return Metric::compare (a, b, d);
+    }
 
-      Cluster ()
-      {
-      }
+    // in double, for seeding weights and spreads
+    static double distance (const Scalar* a, const Scalar* b, size_t d)
+    {
+      return Metric::distance (a, b, d);
+    }
 
-      PointND getCenter () const
-      {
-        return _center;
-      }
+    // the position of the point with input index r, see inputIndex
+    size_t position (size_t r) const
+    {
+      return _position.empty() ? r : _position[r];
+    }
 
-      size_t size () const
-      {
-        return _points.size();
-      }
+    // the number of points added, counting merged duplicates
+    size_t inputCount () const
+    {
+      return _uniqueOf.empty() ? _data.size() : _uniqueOf.size();
+    }
 
-      void remove (const PointND& p)
-      {
-        _points.erase (p);
-      }
+    // the position of the distinct point the r-th added point is
+    size_t inputPosition (size_t r) const
+    {
+      return position (_uniqueOf.empty() ? r : _uniqueOf[r]);
+    }
 
-      void insert (const PointND& p)
-      {
-        _points.insert (p);
-      }
+    uint32_t inputLabel (size_t r) const
+    {
+      return _rowLabels.empty() ? _data[inputPosition (r)].label : _rowLabels[r];
+    }
 
-      double spread () const
-      {
-        double spread = 0.0;
-        for (std::set<PointND>::iterator 
-               i  = _points.begin();
-               i != _points.end();
-             ++i)
-          {
-            spread += i->distance(_center);
-          }
-        //cout << spread << endl;
-        return spread/_points.size();
-      }
+    PointND getPoint (size_t i) const
+    {
+      const Scalar* x = _points.row (i);
+      return PointND (_labels.str (_data[i].label), std::vector<double> (x, x+_points.dims()));
+    }
 
-      void calculateCentroid ()
-      {
-        if (_points.size() == 0)
-          {
-            fill (_center.x.begin(), _center.x.end(), 0.5);
+    size_t centerCount () const
+    {
+      return _centerLabels.size();
+    }
+
+    const Scalar* getCenterRow (size_t c) const
+    {
+      return &_centers[c*_points.dims()];
+    }
+
+    PointND getCenter (size_t c) const
+    {
+      const Scalar* x = getCenterRow (c);
+      return PointND (_labels.str (_centerLabels[c]), std::vector<double> (x, x+_points.dims()));
+    }
+
+    void clearCenters ()
+    {
+      _centers.clear ();
+      _centerLabels.clear ();
+      _sums.clear ();
+      _clusterMass.clear ();
+    }
+
+    template <typename In>
+    void addCenter (const In* x, uint32_t label)
+    {
+      _centers.insert (_centers.end(), x, x+_points.dims());
+      _centerLabels.push_back (label);
+      _sums.resize (_centers.size());
+      _clusterMass.resize (_centerLabels.size());
+    }
+
+    // mass weighted mean distance of each cluster's points to its center
+    std::vector<double> spreads () const
+    {
+      std::vector<double> spread (centerCount(), 0.0);
+      std::vector<double> mass (centerCount(), 0.0);
+      for (size_t i=0; i<_data.size(); i++)
+        {
+          int c = _data[i].clusterid;
+          if (c < 0)
+            continue;
+          spread[c] += _data[i].mass * distance (_points.row (i), getCenterRow (c), _points.dims());
+          mass[c]   += _data[i].mass;
+        }
+      for (size_t c=0; c<spread.size(); c++)
+        if (mass[c] > 0)
+          spread[c] /= mass[c];
+      return spread;
+    }
+
+    //
+    // chunked parallel loops
+    //
+
+    size_t chunkCount () const
+    {
+      return std::max<size_t> (1, std::min (_threads, _data.size()));
+    }
+
+    void chunkRange (size_t chunk, size_t nChunks, size_t& begin, size_t& end) const
+    {
+      begin = _data.size() * chunk / nChunks;
+      end   = _data.size() * (chunk+1) / nChunks;
+    }
+
+    // call f(begin, end, chunk) for each chunk, one thread per chunk
+    template <typename F>
+    void runChunks (size_t nChunks, F f) const
+    {
+      std::vector<std::thread> threads;
+      size_t begin, end;
+      for (size_t t=1; t<nChunks; t++)
+        {
+          chunkRange (t, nChunks, begin, end);
+          threads.push_back (std::thread (f, begin, end, t));
+        }
+      chunkRange (0, nChunks, begin, end);
+      f (begin, end, 0);
+      for (size_t t=0; t<threads.size(); t++)
+        threads[t].join ();
+    }
+
+    void sampleChunk (const SampleChunk& s, size_t /*begin*/, size_t /*end*/, size_t chunk)
+    {
+      const std::vector<double>& cumulative = *s.cumulative;
+      size_t nChunks = s.streams->size();
+      size_t first = s.nSamples * chunk / nChunks;
+      size_t last  = s.nSamples * (chunk+1) / nChunks;
+      double total = cumulative.back();
+      RandomStream& random = (*s.streams)[chunk];
+      std::map<size_t,double>& picked = (*s.picks)[chunk];
+      for (size_t n=first; n<last; n++)
+        {
+          double pick = random.uniform (total);
+          size_t i = std::upper_bound (cumulative.begin(), cumulative.end(), pick) - cumulative.begin();
+          if (i >= _data.size())
+            i = _data.size()-1;
+          picked[i] += total / (s.nSamples * _data[i].weight);
+        }
+    }
+
+    //
+    // bisecting
+    //
+
+    static const int SPLIT_PASSES = 100;
+
+    // split the largest splittable leaves, nThreads at a time, until
+    // there are nClusters leaves or none can be split
+    void splitLeaves ()
+    {
+      size_t nLeaves = 1;
+      while (nLeaves < _nClusters)
+        {
+          // the largest leaves that can still be split, one per thread
+          std::vector<std::pair<double,size_t> > candidates;
+          for (size_t i=0; i<_tree.size(); i++)
+            if (_tree.isLeaf (i) && _tree.node (i).splittable)
+              candidates.push_back (std::make_pair (-_tree.node (i).sse, i));
+          if (candidates.empty())
+            break;
+          size_t nSplits = std::min (candidates.size(), std::min (_threads, _nClusters-nLeaves));
+          std::partial_sort (candidates.begin(), candidates.begin()+nSplits, candidates.end());
+
+          std::vector<Split> splits (nSplits);
+          for (size_t t=0; t<nSplits; t++)
+            {
+              splits[t].node   = candidates[t].second;
+              splits[t].random = _random.split (splits[t].node);
+            }
+          std::vector<std::thread> threads;
+          for (size_t t=1; t<nSplits; t++)
+            threads.push_back (std::thread (boost::bind (&BasicKMeansClusterND::splitNode, this, boost::ref (splits[t]))));
+          splitNode (splits[0]);
+          for (size_t t=0; t<threads.size(); t++)
+            threads[t].join ();
+
+          for (size_t t=0; t<nSplits; t++)
+            {
+              const Split& split = splits[t];
+              if (!split.ok)
+                {
+                  _tree.node (split.node).splittable = false;
+                  continue;
+                }
+              size_t begin = _tree.node (split.node).begin;
+              size_t end   = _tree.node (split.node).end;
+              _tree.addNode (split.node, split.half[0].center.data(), begin, split.mid,
+                             split.half[0].mass, split.half[0].sse);
+              _tree.addNode (split.node, split.half[1].center.data(), split.mid, end,
+                             split.half[1].mass, split.half[1].sse);
+              nLeaves++;
+            }
+        }
+    }
+
+    void measureRange (size_t begin, size_t end, SplitHalf& h) const
+    {
+      size_t d = _points.dims();
+      h.center.assign (d, 0.0);
+      h.mass = 0.0;
+      h.sse  = 0.0;
+      for (size_t j=begin; j<end; j++)
+        {
+          const Scalar* x = _points.row (_order[j]);
+          double m = _data[_order[j]].mass;
+          for (size_t p=0; p<d; p++)
+            h.center[p] += m * x[p];
+          h.mass += m;
+        }
+      if (h.mass == 0)
+        return;
+      for (size_t p=0; p<d; p++)
+        h.center[p] /= h.mass;
+      for (size_t j=begin; j<end; j++)
+        h.sse += _data[_order[j]].mass * Metric::cost (_points.row (_order[j]), h.center.data(), d);
+    }
+
+    // split the points of a leaf in two with 2-means, seeded like the
+    // flat seeding.  Runs on a worker thread: it only touches the
+    // node's own range of _order and of the cluster ids, which hold
+    // the side of each point while it runs.
+    void splitNode (Split& split)
+    {
+      split.ok = false;
+      size_t d     = _points.dims();
+      size_t begin = _tree.node (split.node).begin;
+      size_t end   = _tree.node (split.node).end;
+
+      // first seed by mass, the second by mass times distance to it
+      std::vector<Scalar> seeds (2*d);
+      double total = 0.0;
+      for (size_t j=begin; j<end; j++)
+        total += _data[_order[j]].mass;
+      size_t first = pickInRange (begin, end, split.random.uniform (total), false);
+      std::copy (_points.row (first), _points.row (first) + d, seeds.begin());
+
+      total = 0.0;
+      for (size_t j=begin; j<end; j++)
+        {
+          size_t i = _order[j];
+          _data[i].weight = distance (_points.row (i), &seeds[0], d);
+          total += _data[i].mass * _data[i].weight;
+        }
+      if (total == 0)
+        return;
+      size_t second = pickInRange (begin, end, split.random.uniform (total), true);
+      std::copy (_points.row (second), _points.row (second) + d, seeds.begin() + d);
+
+      for (size_t j=begin; j<end; j++)
+        _data[_order[j]].clusterid = -1;
+      std::vector<double> sums (2*d);
+      for (int pass=0; pass<SPLIT_PASSES; pass++)
+        {
+          bool changed = false;
+          for (size_t j=begin; j<end; j++)
+            {
+              size_t i = _order[j];
+              int side = distanceSquared (_points.row (i), &seeds[d], d)
+                < distanceSquared (_points.row (i), &seeds[0], d) ? 1 : 0;
+              if (side != _data[i].clusterid)
+                {
+                  _data[i].clusterid = side;
+                  changed = true;
+                }
+            }
+          if (!changed)
+            break;
+
+          std::fill (sums.begin(), sums.end(), 0.0);
+          double mass[2] = { 0.0, 0.0 };
+          for (size_t j=begin; j<end; j++)
+            {
+              size_t i = _order[j];
+              int side = _data[i].clusterid;
+              const Scalar* x = _points.row (i);
+              for (size_t p=0; p<d; p++)
+                sums[side*d + p] += _data[i].mass * x[p];
+              mass[side] += _data[i].mass;
+            }
+          if (mass[0] == 0 || mass[1] == 0)
             return;
-          }
+          for (int side=0; side<2; side++)
+            for (size_t p=0; p<d; p++)
+              seeds[side*d + p] = sums[side*d + p] / mass[side];
+        }
 
-        _center.clear();
-        for (std::set<PointND>::iterator 
-               i  = _points.begin();
-               i != _points.end();
-             ++i)
-          {
-            _center += *i;
-          }
-        _center /= _points.size();
-      }
+      split.mid = std::partition (_order.begin() + begin, _order.begin() + end,
+                                  boost::bind (&BasicKMeansClusterND::onFirstSide, this, _1))
+        - _order.begin();
+      if (split.mid == begin || split.mid == end)
+        return;
+      measureRange (begin, split.mid, split.half[0]);
+      measureRange (split.mid, end, split.half[1]);
+      split.ok = true;
+    }
 
-      std::string str() const
-      {
-        return _center.str() + "\n";
-      }
-      
-    private:
-      std::set<PointND>      _points;
-      PointND                _center;
-    };
+    bool onFirstSide (uint32_t i) const
+    {
+      return _data[i].clusterid == 0;
+    }
 
+    // the point of [begin, end) at which the running sum of mass, or
+    // of mass times seeding weight, passes pick
+    size_t pickInRange (size_t begin, size_t end, double pick, bool weighted) const
+    {
+      double running = 0.0;
+      for (size_t j=begin; j<end; j++)
+        {
+          const PointData& p = _data[_order[j]];
+          running += weighted ? p.mass * p.weight : p.mass;
+          if (running > pick)
+            return _order[j];
+        }
+      // rounding can leave the pick just past the last point
+      return _order[end-1];
+    }
 
     //
-    // private data
+    // seeding
     //
 
-    std::vector<PointData>   _data;
-    std::vector<Cluster>     _clusters;
-    size_t                   _nClusters;
+    void weightDataPoints ()
+    {
+      size_t nChunks = chunkCount ();
+      _chunkWeight.assign (nChunks, 0.0);
+      runChunks (nChunks, boost::bind (&BasicKMeansClusterND::weightChunk, this, _1, _2, _3));
+    }
+
+    // update the seeding weights of [begin, end) for the newest center
+    // and record the chunk's total weight
+    void weightChunk (size_t begin, size_t end, size_t chunk)
+    {
+      size_t newestClusterIndex = centerCount()-1;
+      double total = 0.0;
+      for (size_t i=begin; i<end; i++)
+        {
+          if (centerCount() == 0)
+            {
+              _data[i].weight = 1;
+            }
+          else
+            {
+              double dmetric = distance (_points.row (i), getCenterRow (newestClusterIndex), _points.dims());
+              if (_data[i].weight > dmetric)
+                _data[i].weight = dmetric;
+            }
+          total += _data[i].mass * _data[i].weight;
+        }
+      _chunkWeight[chunk] = total;
+    }
+
+    void selectClusterCenter ()
+    {
+      if (_data.empty())
+        return;
+
+      // find the chunk holding the pick from the chunk totals, then
+      // the point within it
+      double pick = randomDouble (getTotalPointWeight ());
+      size_t chunk = 0;
+      for (; chunk+1<_chunkWeight.size(); chunk++)
+        {
+          if (_chunkWeight[chunk] > pick)
+            break;
+          pick -= _chunkWeight[chunk];
+        }
+
+      size_t begin, end;
+      chunkRange (chunk, _chunkWeight.size(), begin, end);
+      double running = 0.0;
+      for (size_t i=begin; i<end; i++)
+        {
+          double w = _data[i].mass * _data[i].weight;
+          if (running + w > pick)
+            {
+              addCenter (_points.row (i), _data[i].label);
+              return;
+            }
+          running += w;
+        }
+      // rounding can leave the pick just past the last point
+      addCenter (_points.row (end-1), _data[end-1].label);
+    }
+
+    double getTotalPointWeight ()
+    {
+      return std::accumulate (_chunkWeight.begin(), _chunkWeight.end(), 0.0);
+    }
+
+    double randomDouble (double d)
+    {
+      return _random.uniform (d);
+    }
+
+    //
+    // clustering loop
+    //
 
     std::vector<PointND> KMeansCluster ()
     {
-      std::vector<PointND> centers;
+      reorderPoints ();
+      prepareLoop ();
       bool changed = true;
       while (changed)
         {
           changed = false;
-          assignAllPoints (changed);
-          calculateCentriods ();
+          uint64_t allocations = heapAllocations ();
+          assignAndUpdate (changed);
+          _loopAllocations += heapAllocations () - allocations;
+          if (changed && _checkpointEvery > 0 && _iterations % _checkpointEvery == 0)
+            {
+              ProfileScope scope (_profiler, "checkpoint");
+              writeCheckpoint ();
+            }
         }
-      return centers;
+      return centers ();
+    }
+
+    // one Lloyd iteration
+    void assignAndUpdate (bool& changed)
+    {
+      {
+        ProfileScope scope (_profiler, "assign");
+        assignAllPoints (changed);
+      }
+      ProfileScope scope (_profiler, "update");
+      calculateCentriods ();
     }
 
     void assignAllPoints (bool & changed)
     {
-      static int count = 0;
       int del = 0;
+      findNearest ();
       for (size_t i=0; i<_data.size(); i++)
         {
-          PointND p = _data[i].point;
-          size_t c = getNearestCluster (p);
+          int c = nearestCluster (i);
           if (c != _data[i].clusterid)
             {
-              if (_data[i].clusterid >= 0)
-                _clusters[_data[i].clusterid].remove (p);
-              _clusters[c].insert (p);
               _data[i].clusterid = c;
               changed = true;
               del++;
             }
         }
-      //std::cerr << "del: " << del << " of: " << _data.size() << " " << ++count << std::endl;
-      if (count > 200 && count > del/2)
+      //std::cerr << "del: " << del << " of: " << _data.size() << " " << _iterations << std::endl;
+      if (++_iterations >= _maxIterations && _maxIterations > 0 && changed)
         {
-          std::cerr << "non-convergent clustring, inspect cluster visually to verify\n";
+          std::cerr << boost::format ("stopped after %d iterations with %d points still moving\n")
+            % _iterations % del;
           changed = false;
         }
     }
     
-    size_t getNearestCluster (const PointND& p) const
+    // move the points into the order of setPointOrder, remembering
+    // where each one came from
+    void reorderPoints ()
+    {
+      if (_pointOrder == INPUT_ORDER || _data.empty())
+        return;
+      ProfileScope scope (_profiler, "reorder");
+      size_t n = _data.size();
+      std::vector<uint32_t> order;
+      if (_pointOrder == ASSIGNMENT_ORDER)
+        assignmentOrder (order);
+      else
+        curveOrder (_points, n, _points.dims(), _pointOrder == HILBERT_ORDER, order);
+
+      _points.gather (order);
+      std::vector<PointData> data (n);
+      std::vector<uint32_t> inputIndexes (n);
+      for (size_t p=0; p<n; p++)
+        {
+          data[p] = _data[order[p]];
+          inputIndexes[p] = inputIndex (order[p]);
+        }
+      _data.swap (data);
+      _inputIndex.swap (inputIndexes);
+      _position.resize (n);
+      for (size_t p=0; p<n; p++)
+        _position[_inputIndex[p]] = p;
+    }
+
+    // a counting sort by cluster, stable so points of a cluster keep
+    // their order; points without a cluster go by their nearest center
+    void assignmentOrder (std::vector<uint32_t>& order) const
+    {
+      size_t n = _data.size();
+      std::vector<uint32_t> cluster (n);
+      std::vector<size_t>   start (centerCount()+1, 0);
+      for (size_t i=0; i<n; i++)
+        {
+          cluster[i] = _data[i].clusterid >= 0 ? _data[i].clusterid : getNearestCluster (_points.row (i));
+          start[cluster[i]+1]++;
+        }
+      for (size_t c=0; c<centerCount(); c++)
+        start[c+1] += start[c];
+      order.resize (n);
+      for (size_t i=0; i<n; i++)
+        order[start[cluster[i]]++] = i;
+    }
+
+    // size the buffers of the index or the blocked engine and of the
+    // median centroids, outside of the loop
+    void prepareLoop ()
+    {
+      if (Metric::MEDIAN_CENTROID)
+        {
+          _medianOrder.resize (_data.size());
+          _medianValues.resize (_data.size());
+          _medianStart.resize (centerCount()+1);
+        }
+      if (_useApproximate)
+        _ivf.reserve (centerCount(), _points.dims());
+      else if (_useBlocked)
+        {
+          _blocked.setPoints (_points.row (0), _data.size(), _points.dims(), _points.stride());
+          _blocked.reserveCenters (centerCount());
+        }
+    }
+
+    // index the current centers; with the blocked engine the nearest
+    // centers of all points are found in one pass here, otherwise one
+    // at a time by nearestCluster
+    void findNearest ()
+    {
+      if (_useApproximate)
+        _ivf.build (_centers.data(), centerCount(), _points.dims());
+      else if (_useBlocked)
+        {
+          _blocked.setCenters (_centers.data(), centerCount());
+          _blocked.assign ();
+        }
+    }
+
+    size_t nearestCluster (size_t i)
+    {
+      if (_useApproximate)
+        return _ivf.nearest (_points.row (i));
+      if (_useBlocked)
+        return _blocked.nearest (i);
+      return getNearestCluster (_points.row (i));
+    }
+
+    // the square root is monotone, so the nearest center is found on
+    // squared distances
+    size_t getNearestCluster (const Scalar* p) const
     {
+      size_t d = _points.dims();
       size_t closest = 0;
-      double distance = _clusters[0].getCenter().distance (p);
-      for (size_t i=1; i<_clusters.size(); i++)
+      Scalar distance = distanceSquared (getCenterRow (0), p, d);
+      for (size_t i=1; i<centerCount(); i++)
         {
-          double d = _clusters[i].getCenter().distance (p);
-          if (d < distance)
+          Scalar dist = distanceSquared (getCenterRow (i), p, d);
+          if (dist < distance)
             {
-              distance = d;
+              distance = dist;
               closest = i;
             }
         }
@@ -359,43 +1479,205 @@ namespace kmcluster
 
     void calculateCentriods ()
     {
-      for (size_t c=0; c<_clusters.size(); c++)
+      if (Metric::MEDIAN_CENTROID)
         {
-          _clusters[c].calculateCentroid ();
+          medianCentroids ();
+          return;
+        }
+
+      size_t d = _points.dims();
+      std::fill (_sums.begin(), _sums.end(), 0.0);
+      std::fill (_clusterMass.begin(), _clusterMass.end(), 0.0);
+
+      for (size_t i=0; i<_data.size(); i++)
+        {
+          int c = _data[i].clusterid;
+          const Scalar* x = _points.row (i);
+          double* sum = &_sums[c*d];
+          for (size_t j=0; j<d; j++)
+            sum[j] += _data[i].mass * x[j];
+          _clusterMass[c] += _data[i].mass;
+        }
+
+      for (size_t c=0; c<centerCount(); c++)
+        {
+          Scalar* center = &_centers[c*d];
+          if (_clusterMass[c] == 0)
+            {
+              std::fill (center, center+d, 0.5);
+              continue;
+            }
+          for (size_t j=0; j<d; j++)
+            center[j] = _sums[c*d+j] / _clusterMass[c];
+          Metric::projectCenter (center, d);
         }
     }
 
-    void selectClusterCenter ()
+    // set each center to the coordinate wise weighted median of its
+    // points, in the buffers sized by prepareLoop
+    void medianCentroids ()
     {
-      double pick = randomDouble (getTotalPointWeight ());
-      double running = 0.0;
+      size_t d = _points.dims();
+      size_t k = centerCount();
+      std::fill (_medianStart.begin(), _medianStart.end(), 0);
+      std::fill (_clusterMass.begin(), _clusterMass.end(), 0.0);
       for (size_t i=0; i<_data.size(); i++)
         {
-          if (running + _data[i].weight > pick)
+          _medianStart[_data[i].clusterid+1]++;
+          _clusterMass[_data[i].clusterid] += _data[i].mass;
+        }
+      for (size_t c=0; c<k; c++)
+        _medianStart[c+1] += _medianStart[c];
+      for (size_t i=0; i<_data.size(); i++)
+        _medianOrder[_medianStart[_data[i].clusterid]++] = i;
+      for (size_t c=k; c>0; c--)
+        _medianStart[c] = _medianStart[c-1];
+      _medianStart[0] = 0;
+
+      for (size_t c=0; c<k; c++)
+        {
+          size_t begin = _medianStart[c];
+          size_t end   = _medianStart[c+1];
+          if (begin == end)
             {
-              _clusters.push_back (Cluster(_data[i].point));
-              return;
+              std::fill (&_centers[c*d], &_centers[c*d] + d, (Scalar)0.5);
+              continue;
+            }
+          for (size_t j=0; j<d; j++)
+            {
+              for (size_t m=begin; m<end; m++)
+                {
+                  size_t i = _medianOrder[m];
+                  _medianValues[m] = std::make_pair (_points.row (i)[j], _data[i].mass);
+                }
+              std::sort (_medianValues.begin() + begin, _medianValues.begin() + end);
+              double half    = _clusterMass[c] / 2;
+              double running = 0.0;
+              size_t m = begin;
+              for (; m+1<end; m++)
+                {
+                  running += _medianValues[m].second;
+                  if (running >= half)
+                    break;
+                }
+              _centers[c*d + j] = _medianValues[m].first;
             }
-          running += _data[i].weight;
         }
     }
 
-    double getTotalPointWeight ()
+    //
+    // checkpoints
+    //
+    // A checkpoint is a native endian binary file:
+    //   "KMCK", uint32 version, uint64 k, d, n,
+    //   int64 iterations, uint64 seed, uint64 random draws,
+    //   k*d double centers, k center labels each as a uint32
+    //   length and its bytes, n int32 cluster ids
+    //
+
+    static const uint32_t CHECKPOINT_VERSION = 3;
+
+    template <typename T>
+    static void writeValue (std::ostream& out, const T& v)
     {
-      double tot=0.0;
-      for (size_t i=0; i<_data.size(); i++)
-        tot += _data[i].weight;
-      return tot;
+      out.write (reinterpret_cast<const char*>(&v), sizeof(v));
     }
 
-    double randomDouble (double d)
+    template <typename T>
+    static T readValue (std::istream& in)
+    {
+      T v;
+      if (!in.read (reinterpret_cast<char*>(&v), sizeof(v)))
+        throw (std::runtime_error ("truncated checkpoint"));
+      return v;
+    }
+
+    void writeCheckpoint () const
     {
-      double ret = (double)rand()/(double)RAND_MAX;
-      return ret*d;
+      std::string tmp = _checkpointFile + ".tmp";
+      {
+        std::ofstream out (tmp.c_str(), std::ios::binary | std::ios::trunc);
+        if (!out)
+          throw (std::runtime_error ("could not write checkpoint: " + tmp));
+
+        out.write ("KMCK", 4);
+        writeValue (out, (uint32_t)CHECKPOINT_VERSION);
+        writeValue (out, (uint64_t)centerCount());
+        writeValue (out, (uint64_t)_points.dims());
+        writeValue (out, (uint64_t)_data.size());
+        writeValue (out, (int64_t)_iterations);
+        writeValue (out, _random.getSeed());
+        writeValue (out, _random.draws());
+        for (size_t j=0; j<_centers.size(); j++)
+          writeValue (out, (double)_centers[j]);
+        for (size_t c=0; c<_centerLabels.size(); c++)
+          {
+            const std::string& label = _labels.str (_centerLabels[c]);
+            writeValue (out, (uint32_t)label.size());
+            out.write (label.data(), label.size());
+          }
+        for (size_t r=0; r<_data.size(); r++)
+          writeValue (out, (int32_t)_data[position (r)].clusterid);
+        if (!out)
+          throw (std::runtime_error ("could not write checkpoint: " + tmp));
+      }
+      if (rename (tmp.c_str(), _checkpointFile.c_str()) != 0)
+        throw (std::runtime_error ("could not rename checkpoint to " + _checkpointFile));
     }
 
+    void readCheckpoint (const std::string& fname)
+    {
+      std::ifstream in (fname.c_str(), std::ios::binary);
+      if (!in)
+        throw (std::runtime_error ("could not open checkpoint: " + fname));
+
+      char magic[4];
+      if (!in.read (magic, 4) || std::string (magic, 4) != "KMCK")
+        throw (std::runtime_error ("not a checkpoint: " + fname));
+      uint32_t version = readValue<uint32_t> (in);
+      if (version != CHECKPOINT_VERSION)
+        throw (std::runtime_error ((boost::format ("unsupported checkpoint version %d") % version).str()));
+
+      uint64_t k = readValue<uint64_t> (in);
+      uint64_t d = readValue<uint64_t> (in);
+      uint64_t n = readValue<uint64_t> (in);
+      if (n != _data.size() || d != _points.dims())
+        throw (std::runtime_error ((boost::format ("checkpoint is for %d points of dimension %d, "
+                                                   "have %d points of dimension %d")
+                                    % n % d % _data.size() % _points.dims()).str()));
+      _iterations  = readValue<int64_t> (in);
+      uint64_t seed  = readValue<uint64_t> (in);
+      uint64_t draws = readValue<uint64_t> (in);
+      _random.seed (seed);
+      _random.discard (draws);
+
+      clearCenters ();
+      std::vector<double> x (k*d);
+      if (k*d > 0 && !in.read (reinterpret_cast<char*>(&x[0]), k*d*sizeof(double)))
+        throw (std::runtime_error ("truncated checkpoint"));
+      std::string label;
+      for (size_t c=0; c<k; c++)
+        {
+          label.resize (readValue<uint32_t> (in));
+          if (label.size() > 0 && !in.read (&label[0], label.size()))
+            throw (std::runtime_error ("truncated checkpoint"));
+          addCenter (&x[c*d], _labels.intern (label));
+        }
+      for (size_t r=0; r<n; r++)
+        {
+          int32_t c = readValue<int32_t> (in);
+          if (c < -1 || c >= (int32_t)k)
+            throw (std::runtime_error ("corrupt cluster id in checkpoint"));
+          _data[position (r)].clusterid = c;
+        }
+    }
   };
 
+  typedef BasicKMeansClusterND<double> KMeansClusterND;
+  typedef BasicKMeansClusterND<float>  KMeansClusterNDf;
+  typedef BasicKMeansClusterND<double, ManhattanMetric> KMediansClusterND;
+  typedef BasicKMeansClusterND<double, CosineMetric>    SphericalKMeansClusterND;
+
 }
 
 #endif  // CLUSTER_KMEANSCLUSTER_H_
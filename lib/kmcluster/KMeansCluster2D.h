@@ -6,8 +6,15 @@
 #include <vector>
 #include <set>
 #include <cmath>
+#include <algorithm>
+#include <stdexcept>
 #include <boost/lexical_cast.hpp>
 #include <boost/format.hpp>
+#include "DelaunayTriangulation.h"
+#include "Random.h"
+#include "Metric.h"
+#include "PointView.h"
+#include "Duplicates.h"
 
 using namespace std;
 
@@ -34,8 +41,9 @@ namespace kmcluster
 
     double distanceSquared (const Point2D& p)
     {
-      return pow((p.x-x)*(p.x-x) + (p.y-y)*(p.y-y),1.0/64.0);
-      //return sqrt((p.x-x)*(p.x-x) + (p.y-y)*(p.y-y));
+      double a[2] = { x, y };
+      double b[2] = { p.x, p.y };
+      return Pow64Metric::distance (a, b, 2);
     }
 
     std::string str () const
@@ -46,16 +54,89 @@ namespace kmcluster
     bool operator<(const Point2D& p) const { return x+y < p.x+p.y; }
   };
 
-  class KMeansCluster2D
+  /**
+   * Metric is a distance policy from Metric.h.  The default keeps the
+   * original pow(d^2, 1/64) distance.
+   */
+  template <typename Metric = Pow64Metric>
+  class BasicKMeansCluster2D
   {
   public:
-    KMeansCluster2D (const std::vector< std::pair<double,double> >& inputData, size_t nClusters)
-      : _data(inputData.size())
+    /**
+     * copies the coordinates of inputData into one flat array; the
+     * view constructor avoids the copy
+     */
+    BasicKMeansCluster2D (const std::vector< std::pair<double,double> >& inputData, size_t nClusters)
+      : _owned(2*inputData.size())
+      , _points(0, 0, 2)
+      , _data(inputData.size())
       , _clusters()
       , _nClusters (nClusters)
+      , _useDelaunay (false)
+      , _centerMesh ()
+      , _random ()
     {
       for (size_t i=0; i<inputData.size(); i++)
-        _data[i] = PointData(Point2D(inputData[i].first,inputData[i].second));
+        {
+          _owned[2*i]   = inputData[i].first;
+          _owned[2*i+1] = inputData[i].second;
+        }
+      _points = PointView (_owned.data(), inputData.size(), 2);
+    }
+
+    /**
+     * cluster 2D points in caller memory, in any layout a PointView
+     * describes, without copying them.  The memory must outlive the
+     * clusterer.
+     */
+    BasicKMeansCluster2D (const PointView& points, size_t nClusters)
+      : _owned()
+      , _points(points)
+      , _data(points.n)
+      , _clusters()
+      , _nClusters (nClusters)
+      , _useDelaunay (false)
+      , _centerMesh ()
+      , _random ()
+    {
+      if (points.d != 2)
+        throw (std::runtime_error ((boost::format ("size mismatch: view of dimension %d given to the 2D clusterer")
+                                    % points.d).str()));
+    }
+
+    /**
+     * a copy owns a copy of the points, or views the same caller memory
+     */
+    BasicKMeansCluster2D (const BasicKMeansCluster2D& other)
+      : _owned(other._owned)
+      , _points(other._points)
+      , _data(other._data)
+      , _clusters(other._clusters)
+      , _nClusters (other._nClusters)
+      , _useDelaunay (other._useDelaunay)
+      , _centerMesh (other._centerMesh)
+      , _random (other._random)
+    {
+      if (other.owning ())
+        _points.data = _owned.data();
+    }
+
+    BasicKMeansCluster2D& operator= (const BasicKMeansCluster2D& other)
+    {
+      if (this != &other)
+        {
+          _owned       = other._owned;
+          _points      = other._points;
+          _data        = other._data;
+          _clusters    = other._clusters;
+          _nClusters   = other._nClusters;
+          _useDelaunay = other._useDelaunay;
+          _centerMesh  = other._centerMesh;
+          _random      = other._random;
+          if (other.owning ())
+            _points.data = _owned.data();
+        }
+      return *this;
     }
 
     std::vector<Point2D> cluster () 
@@ -79,6 +160,84 @@ namespace kmcluster
       return out;
     }
 
+    /**
+     * Merge exact duplicates into one point that counts for all of
+     * them, and return the number of distinct points.  Call it before
+     * clustering; the distinct points are copied into the clusterer,
+     * so a view of caller memory is no longer read afterwards.
+     *
+     * Seeding weighs each point by its count, and the centroids are
+     * means over the distinct points of a cluster with or without
+     * deduplication, so the run solves the same problem while every
+     * pass costs distinct points.  A seeding draw lands on the merged
+     * point where the full run walks through the copies one by one, so
+     * a given seed picks other centers than without it.
+     */
+    size_t deduplicate ()
+    {
+      std::vector<uint32_t> classOf, first;
+      findDuplicates (_points, _data.size(), 2, classOf, first);
+
+      std::vector<double>    owned (2*first.size());
+      std::vector<PointData> data (first.size());
+      for (size_t c=0; c<first.size(); c++)
+        {
+          owned[2*c]   = _points.at (first[c], 0);
+          owned[2*c+1] = _points.at (first[c], 1);
+          data[c].count = 0;
+        }
+      for (size_t i=0; i<_data.size(); i++)
+        data[classOf[i]].count += _data[i].count;
+      _owned.swap (owned);
+      _data.swap (data);
+      _points = PointView (_owned.data(), _data.size(), 2);
+      return _data.size();
+    }
+
+    /**
+     * reseed the random stream used to pick the initial centers
+     */
+    void setSeed (uint64_t seed)
+    {
+      _random.seed (seed);
+    }
+
+    /**
+     * when enabled, the centers are triangulated at the start of each
+     * iteration and points are assigned with a point location in the
+     * Delaunay triangulation instead of a scan over every center.
+     * This pays off once there are more than a few dozen clusters.
+     * Only for metrics whose nearest center is the euclidean one.
+     */
+    void setDelaunaySearch (bool useDelaunay)
+    {
+      if (useDelaunay && !Metric::EUCLIDEAN_MONOTONE)
+        throw (std::runtime_error ("Delaunay search needs a metric that is monotone in the euclidean distance"));
+      _useDelaunay = useDelaunay;
+    }
+
+    /**
+     * the number of points whose nearest center in the triangulation
+     * of the current centers differs from the one a scan finds.  The
+     * triangulation finds the euclidean nearest center, so a metric
+     * that rounds near ties to exact ties, like Pow64Metric, can
+     * break them differently than the scan's lowest index.
+     */
+    size_t delaunayFlips ()
+    {
+      if (_clusters.empty())
+        return 0;
+      triangulateCenters ();
+      size_t flips = 0;
+      for (size_t i=0; i<_data.size(); i++)
+        {
+          Point2D p = point (i);
+          if (_centerMesh.nearest (bpoint2_t (p.x, p.y)) != scanNearestCluster (p))
+            flips++;
+        }
+      return flips;
+    }
+
   private:
 
     void weightDataPoints ()
@@ -92,35 +251,30 @@ namespace kmcluster
             }
           else
             {
-              double dmetric = _data[i].point.distanceSquared (_clusters[newestClusterIndex].getCenter());
+              double dmetric = distance (point (i), _clusters[newestClusterIndex].getCenter());
               if (_data[i].weight > dmetric)
                 _data[i].weight = dmetric;
             }
         }
     }
 
+    // the coordinates live in _points, this is only the per point
+    // state of the clustering
     struct PointData
     {
-      Point2D   point;
       int       clusterid;
       double    weight;
-
-      PointData (const Point2D& p)
-        : point(p)
-        , clusterid(-1)
-        , weight (0.0)
-      { }
+      double    count;      // input points merged into this one
 
       PointData ()
-        : point()
-        , clusterid(-1)
+        : clusterid(-1)
         , weight (0.0)
+        , count (1.0)
       { }
 
       std::string str() const
       {
-        return (boost::format("%s %d %.3f\n") 
-                % point.str()
+        return (boost::format("%d %.3f\n") 
                 % clusterid
                 % weight).str();
       }
@@ -168,7 +322,7 @@ namespace kmcluster
           }
 
         double x=0.0, y=0.0;
-        for (std::set<Point2D>::iterator 
+        for (typename std::set<Point2D>::iterator 
                i  = _points.begin();
                i != _points.end();
              ++i)
@@ -178,8 +332,15 @@ namespace kmcluster
           }
         x /= _points.size();
         y /= _points.size();
-        _center.x = x;
-        _center.y = y;
+        double c[2] = { x, y };
+        Metric::projectCenter (c, 2);
+        _center.x = c[0];
+        _center.y = c[1];
+      }
+
+      void setCenter (const Point2D& p)
+      {
+        _center = p;
       }
 
       std::string str() const
@@ -192,9 +353,14 @@ namespace kmcluster
       Point2D                _center;
     };
 
+    std::vector<double>      _owned;      // coordinates, when not viewing caller memory
+    PointView                _points;
     std::vector<PointData>   _data;
     std::vector<Cluster>     _clusters;
     size_t                   _nClusters;
+    bool                     _useDelaunay;
+    DelaunayTriangulation    _centerMesh;
+    RandomStream             _random;
 
     std::vector<Point2D> KMeansCluster ()
     {
@@ -203,6 +369,8 @@ namespace kmcluster
       while (changed)
         {
           changed = false;
+          if (_useDelaunay)
+            triangulateCenters ();
           assignAllPoints (changed);
           calculateCentriods ();
         }
@@ -215,9 +383,9 @@ namespace kmcluster
       int del = 0;
       for (size_t i=0; i<_data.size(); i++)
         {
-          Point2D p = _data[i].point;
+          Point2D p = point (i);
           size_t c = getNearestCluster (p);
-          if (c != _data[i].clusterid)
+          if ((int)c != _data[i].clusterid)
             {
               if (_data[i].clusterid >= 0)
                 _clusters[_data[i].clusterid].remove (p);
@@ -235,13 +403,61 @@ namespace kmcluster
         }
     }
 
+    void triangulateCenters ()
+    {
+      std::vector<bpoint2_t> sites (_clusters.size());
+      for (size_t i=0; i<_clusters.size(); i++)
+        {
+          Point2D c = _clusters[i].getCenter();
+          sites[i] = bpoint2_t (c.x, c.y);
+        }
+      _centerMesh.build (sites);
+    }
+
+    // true if _points reads _owned rather than caller memory
+    bool owning () const
+    {
+      return _points.data == _owned.data();
+    }
+
+    Point2D point (size_t i) const
+    {
+      return Point2D (_points.at (i, 0), _points.at (i, 1));
+    }
+
+    static double compare (const Point2D& p, const Point2D& q)
+    {
+      double a[2] = { p.x, p.y };
+      double b[2] = { q.x, q.y };
+      return Metric::compare (a, b, 2);
+    }
+
+    static double distance (const Point2D& p, const Point2D& q)
+    {
+      double a[2] = { p.x, p.y };
+      double b[2] = { q.x, q.y };
+      return Metric::distance (a, b, 2);
+    }
+
+    // the metric is monotone in the euclidean distance whenever the
+    // Delaunay search is on, so the nearest site of the triangulation
+    // is also the nearest center
     size_t getNearestCluster (const Point2D& p)
+    {
+      if (_useDelaunay && _centerMesh.size() == _clusters.size())
+        return _centerMesh.nearest (bpoint2_t (p.x, p.y));
+      return scanNearestCluster (p);
+    }
+
+    // the nearest center by a scan over every center; ties go to the
+    // lower index
+    size_t scanNearestCluster (const Point2D& p) const
     {
       size_t closest = 0;
-      double distance = _clusters[0].getCenter().distanceSquared (p);
+      double distance = compare (_clusters[0].getCenter(), p);
       for (size_t i=1; i<_clusters.size(); i++)
         {
-          double d = _clusters[i].getCenter().distanceSquared (p);
+          double d = compare (_clusters[i].getCenter(), p);
           if (d < distance)
             {
               distance = d;
@@ -253,24 +469,73 @@ namespace kmcluster
 
     void calculateCentriods ()
     {
+      if (Metric::MEDIAN_CENTROID)
+        {
+          medianCentroids ();
+          return;
+        }
       for (size_t c=0; c<_clusters.size(); c++)
         {
           _clusters[c].calculateCentroid ();
         }
     }
 
+    // the coordinate wise median of each cluster, over every point
+    // weighted by its count.  A cluster's point set holds one point per
+    // coordinate sum, so it is no sample to take a median of.
+    void medianCentroids ()
+    {
+      typedef std::vector<std::pair<double,double> > Values;
+      std::vector<Values> xs (_clusters.size()), ys (_clusters.size());
+      std::vector<double> mass (_clusters.size(), 0.0);
+      for (size_t i=0; i<_data.size(); i++)
+        {
+          int c = _data[i].clusterid;
+          if (c < 0)
+            continue;
+          xs[c].push_back (std::make_pair (_points.at (i, 0), _data[i].count));
+          ys[c].push_back (std::make_pair (_points.at (i, 1), _data[i].count));
+          mass[c] += _data[i].count;
+        }
+      for (size_t c=0; c<_clusters.size(); c++)
+        {
+          if (xs[c].empty())
+            _clusters[c].setCenter (Point2D (.5, .5));
+          else
+            _clusters[c].setCenter (Point2D (weightedMedian (xs[c], mass[c]),
+                                             weightedMedian (ys[c], mass[c])));
+        }
+    }
+
+    // the lower weighted median of (value, weight) pairs
+    static double weightedMedian (std::vector<std::pair<double,double> >& values, double mass)
+    {
+      std::sort (values.begin(), values.end());
+      double half    = mass / 2;
+      double running = 0.0;
+      size_t m = 0;
+      for (; m+1<values.size(); m++)
+        {
+          running += values[m].second;
+          if (running >= half)
+            break;
+        }
+      return values[m].first;
+    }
+
     void selectClusterCenter ()
     {
       double pick = randomDouble (getTotalPointWeight ());
       double running = 0.0;
       for (size_t i=0; i<_data.size(); i++)
         {
-          if (running + _data[i].weight > pick)
+          double w = _data[i].count * _data[i].weight;
+          if (running + w > pick)
             {
-              _clusters.push_back (Cluster(_data[i].point));
+              _clusters.push_back (Cluster(point (i)));
               return;
             }
-          running += _data[i].weight;
+          running += w;
         }
     }
 
@@ -278,17 +543,18 @@ namespace kmcluster
     {
       double tot=0.0;
       for (size_t i=0; i<_data.size(); i++)
-        tot += _data[i].weight;
+        tot += _data[i].count * _data[i].weight;
       return tot;
     }
 
     double randomDouble (double d)
     {
-      double ret = (double)rand()/(double)RAND_MAX;
-      return ret*d;
+      return _random.uniform (d);
     }
   };
 
+  typedef BasicKMeansCluster2D<> KMeansCluster2D;
+
 }
 
 #endif  // CLUSTER_KMEANSCLUSTER_2D_H_
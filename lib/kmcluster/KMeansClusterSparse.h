@@ -0,0 +1,287 @@
+#ifndef CLUSTER_KMEANSCLUSTER_SPARSE_H_
+#define CLUSTER_KMEANSCLUSTER_SPARSE_H_
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <boost/format.hpp>
+#include "SparseMatrix.h"
+#include "Random.h"
+
+namespace kmcluster
+{
+  /**
+   * KMeans++ clustering of sparse points (bag-of-words, one-hot
+   * features) held in a SparseMatrix.
+   *
+   * Centers are dense, points stay sparse.  The squared distance is
+   * expanded as |x|^2 - 2 x.c + |c|^2, where |x|^2 is stored with each
+   * row and |c|^2 is cached once per iteration, so assigning a point
+   * costs one sparse dot product per center and the centroid update
+   * touches only the nonzeros.
+   */
+  class KMeansClusterSparse
+  {
+  public:
+    KMeansClusterSparse (size_t nClusters)
+      : _data()
+      , _clusterid()
+      , _weight()
+      , _centers()
+      , _centerNorms()
+      , _sizes()
+      , _nClusters (nClusters)
+      , _nDims (0)
+      , _maxIterations (0)
+      , _random ()
+    { }
+
+    void add (const std::string& label, const std::vector<sparse_entry_t>& entries)
+    {
+      _data.addRow (label, entries);
+    }
+
+    /**
+     * stop iterating after n iterations even if points still move,
+     * with a warning; 0, the default, iterates until no point moves
+     */
+    void setMaxIterations (int n)
+    {
+      _maxIterations = n;
+    }
+
+    /**
+     * reseed the random stream used to pick the initial centers
+     */
+    void setSeed (uint64_t seed)
+    {
+      _random.seed (seed);
+    }
+
+    const SparseMatrix& data () const
+    {
+      return _data;
+    }
+
+    void cluster ()
+    {
+      _nDims = _data.columns();
+      _clusterid.assign (_data.rows(), -1);
+      _weight.assign (_data.rows(), 0.0);
+      _centers.clear ();
+      _centerNorms.clear ();
+
+      // select initial seeds for clusters
+      for (size_t i=0; i<_nClusters; i++)
+        {
+          weightDataPoints ();
+          selectClusterCenter ();
+        }
+      KMeansCluster ();
+    }
+
+    std::string str() const
+    {
+      std::string out;
+      for (size_t c=0; c<_centerNorms.size(); c++)
+        {
+          const double* center = getCenter (c);
+          for (size_t j=0; j<_nDims; j++)
+            if (center[j] != 0)
+              out += boost::str (boost::format("%d:%.12f,") % j % center[j]);
+          out += "\n";
+        }
+      return out;
+    }
+
+    std::string clusterSets () const
+    {
+      std::vector<std::string> clusterStrings(_nClusters);
+      std::vector<double>      spread(_nClusters, 0.0);
+
+      for (size_t i=0; i<_data.rows(); i++)
+        spread[_clusterid[i]] += sqrt (distanceSquared (i, _clusterid[i]));
+
+      double totalSpread = 0.0;
+      for (size_t c=0; c<_centerNorms.size(); c++)
+        {
+          if (_sizes[c] > 0)
+            spread[c] /= _sizes[c];
+          totalSpread += spread[c];
+          clusterStrings[c] = (boost::format("cluster %d spread %f\n") % c % spread[c]).str();
+        }
+      std::cout << "total spread: " << totalSpread << std::endl;
+
+      for (size_t i=0; i<_data.rows(); i++)
+        clusterStrings[_clusterid[i]] += _data.rowStr (i) + "\n";
+
+      std::string ret;
+      for (size_t i=0; i<_nClusters; i++)
+        ret += clusterStrings[i] + "\n";
+
+      return ret;
+    }
+
+  private:
+
+    //
+    // private data
+    //
+
+    SparseMatrix             _data;
+    std::vector<int>         _clusterid;
+    std::vector<double>      _weight;
+    std::vector<double>      _centers;      // dense, _nDims per center
+    std::vector<double>      _centerNorms;  // |c|^2, refreshed with the centers
+    std::vector<size_t>      _sizes;
+    size_t                   _nClusters;
+    size_t                   _nDims;
+    int                      _maxIterations;  // 0 for no limit
+    RandomStream             _random;
+
+    const double* getCenter (size_t c) const
+    {
+      return &_centers[c*_nDims];
+    }
+
+    double distanceSquared (size_t row, size_t c) const
+    {
+      double d = _data.squaredNorm (row) - 2*_data.dot (row, getCenter (c)) + _centerNorms[c];
+      // cancellation can leave a tiny negative value for a point
+      // sitting on its center
+      return d > 0 ? d : 0;
+    }
+
+    void weightDataPoints ()
+    {
+      size_t newestClusterIndex = _centerNorms.size()-1;
+      for (size_t i=0; i<_data.rows(); i++)
+        {
+          if (_centerNorms.size() == 0)
+            {
+              _weight[i] = 1;
+            }
+          else
+            {
+              double dmetric = sqrt (distanceSquared (i, newestClusterIndex));
+              if (_weight[i] > dmetric)
+                _weight[i] = dmetric;
+            }
+        }
+    }
+
+    void selectClusterCenter ()
+    {
+      double pick = randomDouble (getTotalPointWeight ());
+      double running = 0.0;
+      for (size_t i=0; i<_data.rows(); i++)
+        {
+          if (running + _weight[i] > pick)
+            {
+              _centers.resize (_centers.size() + _nDims, 0.0);
+              _data.addTo (i, &_centers[_centers.size() - _nDims]);
+              _centerNorms.push_back (_data.squaredNorm (i));
+              return;
+            }
+          running += _weight[i];
+        }
+    }
+
+    void KMeansCluster ()
+    {
+      int count = 0;
+      bool changed = true;
+      while (changed)
+        {
+          changed = false;
+          size_t del = assignAllPoints (changed);
+          calculateCentriods ();
+          if (++count >= _maxIterations && _maxIterations > 0 && changed)
+            {
+              std::cerr << boost::format ("stopped after %d iterations with %d points still moving\n")
+                % count % del;
+              changed = false;
+            }
+        }
+    }
+
+    size_t assignAllPoints (bool & changed)
+    {
+      size_t del = 0;
+      for (size_t i=0; i<_data.rows(); i++)
+        {
+          int c = getNearestCluster (i);
+          if (c != _clusterid[i])
+            {
+              _clusterid[i] = c;
+              changed = true;
+              del++;
+            }
+        }
+      return del;
+    }
+
+    int getNearestCluster (size_t row) const
+    {
+      // |x|^2 is the same for every center, so only the dot product
+      // and the cached center norm take part in the comparison
+      int    closest  = 0;
+      double distance = _centerNorms[0] - 2*_data.dot (row, getCenter (0));
+      for (size_t c=1; c<_centerNorms.size(); c++)
+        {
+          double d = _centerNorms[c] - 2*_data.dot (row, getCenter (c));
+          if (d < distance)
+            {
+              distance = d;
+              closest = c;
+            }
+        }
+      return closest;
+    }
+
+    void calculateCentriods ()
+    {
+      std::vector<double> sums (_centers.size(), 0.0);
+      _sizes.assign (_centerNorms.size(), 0);
+      for (size_t i=0; i<_data.rows(); i++)
+        {
+          _data.addTo (i, &sums[_clusterid[i]*_nDims]);
+          _sizes[_clusterid[i]]++;
+        }
+
+      for (size_t c=0; c<_centerNorms.size(); c++)
+        {
+          // an empty cluster keeps its previous center
+          if (_sizes[c] == 0)
+            continue;
+
+          double norm = 0.0;
+          double* center = &_centers[c*_nDims];
+          for (size_t j=0; j<_nDims; j++)
+            {
+              center[j] = sums[c*_nDims+j] / _sizes[c];
+              norm += center[j]*center[j];
+            }
+          _centerNorms[c] = norm;
+        }
+    }
+
+    double getTotalPointWeight ()
+    {
+      double tot=0.0;
+      for (size_t i=0; i<_weight.size(); i++)
+        tot += _weight[i];
+      return tot;
+    }
+
+    double randomDouble (double d)
+    {
+      return _random.uniform (d);
+    }
+  };
+
+}
+
+#endif  // CLUSTER_KMEANSCLUSTER_SPARSE_H_
@@ -0,0 +1,240 @@
+#ifndef CLUSTER_METRIC_H_
+#define CLUSTER_METRIC_H_
+
+#include <cmath>
+#include <cstddef>
+#include "Distance.h"
+
+namespace kmcluster
+{
+  //
+  // Distance metric policies.
+  //
+  // A clusterer takes its metric as a template parameter and calls its
+  // static members directly, so every kernel is inlined into the
+  // assignment loop with no virtual call and no branch on the metric.
+  // A metric provides
+  //
+  //   compare (a, b, d)    a value in T whose order is the order of
+  //                        the distances, used to find nearest centers
+  //   cost (a, b, d)       the per point cost the clustering minimizes,
+  //                        in double: coresets sample by it and inertia
+  //                        sums it
+  //   distance (a, b, d)   the distance itself, in double: the D weights
+  //                        of the seeding and the cluster spreads
+  //   projectCenter (c, d) applied to each mean centroid
+  //   name ()              how model files and command lines call it
+  //
+  // and these properties:
+  //
+  //   EUCLIDEAN_MONOTONE   the nearest center is the euclidean nearest
+  //                        center, so the dot product expansion of the
+  //                        blocked engine and the Delaunay search apply.
+  //                        Their setters throw for other metrics.
+  //   MEDIAN_CENTROID      centers are coordinate wise weighted medians
+  //                        rather than means
+  //
+
+  /**
+   * Plain k-means.  Nearest centers are compared on squared distances,
+   * which the square root does not reorder.
+   */
+  struct EuclideanMetric
+  {
+    static const bool EUCLIDEAN_MONOTONE  = true;
+    static const bool MEDIAN_CENTROID     = false;
+
+    static const char* name ()
+    {
+      return "euclidean";
+    }
+
+    template <typename T>
+    static T compare (const T* a, const T* b, size_t d)
+    {
+      return distanceSquared (a, b, d);
+    }
+
+    template <typename A, typename B>
+    static double cost (const A* a, const B* b, size_t d)
+    {
+      double dist = 0;
+      for (size_t j=0; j<d; j++)
+        {
+          double diff = (double)a[j]-(double)b[j];
+          dist += diff*diff;
+        }
+      return dist;
+    }
+
+    template <typename A, typename B>
+    static double distance (const A* a, const B* b, size_t d)
+    {
+      return sqrt (cost (a, b, d));
+    }
+
+    template <typename T>
+    static void projectCenter (T* /*c*/, size_t /*d*/)
+    { }
+  };
+
+  /**
+   * k-medians: the L1 distance, with the coordinate wise median as the
+   * center that minimizes it.
+   */
+  struct ManhattanMetric
+  {
+    static const bool EUCLIDEAN_MONOTONE  = false;
+    static const bool MEDIAN_CENTROID     = true;
+
+    static const char* name ()
+    {
+      return "manhattan";
+    }
+
+    template <typename T>
+    static T compare (const T* a, const T* b, size_t d)
+    {
+      const size_t LANES = 8;
+      T lane[LANES] = { 0 };
+      size_t j = 0;
+      for (; j+LANES<=d; j+=LANES)
+        for (size_t l=0; l<LANES; l++)
+          lane[l] += std::abs (a[j+l]-b[j+l]);
+      T dist = 0;
+      for (size_t l=0; l<LANES; l++)
+        dist += lane[l];
+      for (; j<d; j++)
+        dist += std::abs (a[j]-b[j]);
+      return dist;
+    }
+
+    template <typename A, typename B>
+    static double cost (const A* a, const B* b, size_t d)
+    {
+      double dist = 0;
+      for (size_t j=0; j<d; j++)
+        dist += std::abs ((double)a[j]-(double)b[j]);
+      return dist;
+    }
+
+    template <typename A, typename B>
+    static double distance (const A* a, const B* b, size_t d)
+    {
+      return cost (a, b, d);
+    }
+
+    template <typename T>
+    static void projectCenter (T* /*c*/, size_t /*d*/)
+    { }
+  };
+
+  /**
+   * Spherical k-means: one minus the cosine similarity, with centers
+   * projected back onto the unit sphere.  A zero vector is at distance
+   * one from everything.  Not a metric, so no distance bounds.
+   */
+  struct CosineMetric
+  {
+    static const bool EUCLIDEAN_MONOTONE  = false;
+    static const bool MEDIAN_CENTROID     = false;
+
+    static const char* name ()
+    {
+      return "cosine";
+    }
+
+    template <typename T>
+    static T compare (const T* a, const T* b, size_t d)
+    {
+      T dot = 0, na = 0, nb = 0;
+      for (size_t j=0; j<d; j++)
+        {
+          dot += a[j]*b[j];
+          na  += a[j]*a[j];
+          nb  += b[j]*b[j];
+        }
+      if (na == 0 || nb == 0)
+        return 1;
+      return 1 - dot / std::sqrt (na*nb);
+    }
+
+    template <typename A, typename B>
+    static double cost (const A* a, const B* b, size_t d)
+    {
+      double dot = 0, na = 0, nb = 0;
+      for (size_t j=0; j<d; j++)
+        {
+          dot += (double)a[j]*b[j];
+          na  += (double)a[j]*a[j];
+          nb  += (double)b[j]*b[j];
+        }
+      if (na == 0 || nb == 0)
+        return 1;
+      return 1 - dot / sqrt (na*nb);
+    }
+
+    template <typename A, typename B>
+    static double distance (const A* a, const B* b, size_t d)
+    {
+      return cost (a, b, d);
+    }
+
+    template <typename T>
+    static void projectCenter (T* c, size_t d)
+    {
+      double norm = 0;
+      for (size_t j=0; j<d; j++)
+        norm += (double)c[j]*c[j];
+      if (norm == 0)
+        return;
+      norm = sqrt (norm);
+      for (size_t j=0; j<d; j++)
+        c[j] /= norm;
+    }
+  };
+
+  /**
+   * The original metric of the 2D clusterer: the squared distance to
+   * the power 1/64.  It flattens the D weights of the seeding, so
+   * seeds are spread almost uniformly instead of towards outliers.
+   * It is monotone in the euclidean distance, so nearest centers are
+   * the euclidean ones, except that the flattening rounds some near
+   * ties to exact ties.
+   */
+  struct Pow64Metric
+  {
+    static const bool EUCLIDEAN_MONOTONE  = true;
+    static const bool MEDIAN_CENTROID     = false;
+
+    static const char* name ()
+    {
+      return "pow64";
+    }
+
+    template <typename T>
+    static T compare (const T* a, const T* b, size_t d)
+    {
+      return std::pow (distanceSquared (a, b, d), (T)(1.0/64.0));
+    }
+
+    template <typename A, typename B>
+    static double cost (const A* a, const B* b, size_t d)
+    {
+      return pow (EuclideanMetric::cost (a, b, d), 1.0/64.0);
+    }
+
+    template <typename A, typename B>
+    static double distance (const A* a, const B* b, size_t d)
+    {
+      return cost (a, b, d);
+    }
+
+    template <typename T>
+    static void projectCenter (T* /*c*/, size_t /*d*/)
+    { }
+  };
+
+}
+
+#endif  // CLUSTER_METRIC_H_
@@ -0,0 +1,69 @@
+#ifndef CLUSTER_MIXEDPRECISION_H_
+#define CLUSTER_MIXEDPRECISION_H_
+
+#include <string>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include <boost/format.hpp>
+#include "KMeansCluster.h"
+
+namespace kmcluster
+{
+  /**
+   * Compare a run on float storage with a run on double storage over
+   * the same points and report how far the float results drift.
+   *
+   * Both runs are expected to have been seeded alike, so the clusters
+   * line up by index.  When a float comparison flips an early seeding
+   * or assignment decision the numbering can still diverge, so the
+   * agreement is also given after mapping each float cluster onto the
+   * double cluster that holds most of its points.
+   */
+  template <typename Exact, typename Mixed>
+  std::string mixedPrecisionReport (const Exact& exact, const Mixed& mixed)
+  {
+    std::vector<int> a = exact.assignments ();
+    std::vector<int> b = mixed.assignments ();
+    if (a.size() != b.size())
+      throw (std::runtime_error ((boost::format ("cannot compare runs over %d and %d points")
+                                  % a.size() % b.size()).str()));
+
+    size_t k = 0;
+    for (size_t i=0; i<a.size(); i++)
+      k = std::max (k, (size_t)std::max (a[i], b[i]) + 1);
+
+    // contingency table of float cluster against double cluster
+    std::vector<size_t> table (k*k, 0);
+    size_t same = 0;
+    for (size_t i=0; i<a.size(); i++)
+      {
+        if (a[i] == b[i])
+          same++;
+        if (a[i] >= 0 && b[i] >= 0)
+          table[b[i]*k + a[i]]++;
+      }
+    size_t mapped = 0;
+    for (size_t c=0; c<k; c++)
+      mapped += *std::max_element (table.begin() + c*k, table.begin() + (c+1)*k);
+
+    double n        = std::max<size_t> (a.size(), 1);
+    double inertia  = exact.inertia ();
+    double inertiaf = mixed.inertia ();
+    double relative = inertia > 0 ? (inertiaf - inertia) / inertia : 0.0;
+
+    std::string out;
+    out += (boost::format ("points:             %d\n") % a.size()).str();
+    out += (boost::format ("same cluster:       %d (%.4f%%)\n") % same % (100.0*same/n)).str();
+    out += (boost::format ("after relabeling:   %d (%.4f%%)\n") % mapped % (100.0*mapped/n)).str();
+    out += (boost::format ("inertia double:     %.10g\n") % inertia).str();
+    out += (boost::format ("inertia float:      %.10g (%+.3g relative)\n") % inertiaf % relative).str();
+    out += (boost::format ("float comparisons:  %d nearest centers differ from double\n")
+            % mixed.comparisonFlips()).str();
+    return out;
+  }
+
+}
+
+#endif  // CLUSTER_MIXEDPRECISION_H_
@@ -0,0 +1,167 @@
+#ifndef CLUSTER_MODELPROTOCOL_H_
+#define CLUSTER_MODELPROTOCOL_H_
+
+#include <string>
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <boost/format.hpp>
+
+namespace kmcluster
+{
+  //
+  // The wire format of clusterd, the model server, over a Unix domain
+  // socket.  Both ends are on the same host, so integers and doubles
+  // go in native byte order.
+  //
+  // A connection carries any number of requests, each answered before
+  // the next is read.  A request is a ModelRequest followed by its
+  // payload:
+  //
+  //   MODEL_ASSIGN   n*d doubles, n points row major.  The answer
+  //                  carries n uint32 cluster ids.
+  //   MODEL_INFO     nothing.  The answer has the model's k in n, its
+  //                  dimension in d and no payload.
+  //   MODEL_RELOAD   n bytes of a file name: a model file written by
+  //                  testcluster --save-model with the server's metric,
+  //                  or a data file to train a new model with the
+  //                  current k and metric on.  The server answers at
+  //                  once and swaps in the new model when it is
+  //                  ready; queries go on meanwhile.  The name is
+  //                  opened as given, so only trusted callers should
+  //                  be able to reach the socket.
+  //
+  // Every answer is a ModelResponse, with the version of the model that
+  // served it, followed by its payload if the status is MODEL_OK.
+  //
+
+  static const uint32_t MODEL_REQUEST_MAGIC  = 0x514d4b31;   // "1KMQ" in little endian
+  static const uint32_t MODEL_RESPONSE_MAGIC = 0x524d4b31;
+
+  // the largest number of doubles in one request, 512 MB
+  static const uint32_t MODEL_MAX_VALUES = 1u << 26;
+
+  enum ModelOp
+  {
+    MODEL_ASSIGN = 1,
+    MODEL_INFO   = 2,
+    MODEL_RELOAD = 3
+  };
+
+  enum ModelStatus
+  {
+    MODEL_OK          = 0,
+    MODEL_BAD_REQUEST = 1,
+    MODEL_WRONG_DIMS  = 2,
+    MODEL_BUSY        = 3    // a reload is already running
+  };
+
+  struct ModelRequest
+  {
+    uint32_t  magic;
+    uint32_t  op;
+    uint32_t  n;
+    uint32_t  d;
+  };
+
+  struct ModelResponse
+  {
+    uint32_t  magic;
+    uint32_t  status;
+    uint32_t  n;
+    uint32_t  d;
+    uint32_t  version;
+  };
+
+  inline void socketWriteAll (int fd, const void* buf, size_t n)
+  {
+    const char* p = static_cast<const char*>(buf);
+    while (n > 0)
+      {
+        ssize_t w = ::send (fd, p, n, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR)
+          continue;
+        if (w <= 0)
+          throw (std::runtime_error ((boost::format ("socket write failed: %s") % strerror (errno)).str()));
+        p += w;
+        n -= w;
+      }
+  }
+
+  /**
+   * read exactly n bytes.  Returns false if the peer closed the
+   * connection before the first byte, throws if it did so midway.
+   */
+  inline bool socketReadAll (int fd, void* buf, size_t n)
+  {
+    char* p = static_cast<char*>(buf);
+    size_t got = 0;
+    while (got < n)
+      {
+        ssize_t r = ::read (fd, p+got, n-got);
+        if (r < 0 && errno == EINTR)
+          continue;
+        if (r == 0 && got == 0)
+          return false;
+        if (r <= 0)
+          throw (std::runtime_error ("socket closed in the middle of a message"));
+        got += r;
+      }
+    return true;
+  }
+
+  inline sockaddr_un socketAddress (const std::string& path)
+  {
+    sockaddr_un addr;
+    memset (&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+      throw (std::runtime_error ("socket path too long: " + path));
+    strcpy (addr.sun_path, path.c_str());
+    return addr;
+  }
+
+  /**
+   * a listening socket at path, readable and writable by its owner
+   * only, replacing a stale socket file.  Any other kind of file at
+   * path is left alone and is an error.
+   */
+  inline int listenSocket (const std::string& path)
+  {
+    sockaddr_un addr = socketAddress (path);
+    struct stat st;
+    if (lstat (path.c_str(), &st) == 0)
+      {
+        if (!S_ISSOCK (st.st_mode))
+          throw (std::runtime_error ("not replacing a file that is not a socket: " + path));
+        unlink (path.c_str());
+      }
+    int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+      throw (std::runtime_error ((boost::format ("could not create socket: %s") % strerror (errno)).str()));
+    // only the owner may connect: RELOAD reads any file the server can
+    if (bind (fd, (sockaddr*)&addr, sizeof(addr)) != 0 || chmod (path.c_str(), 0600) != 0
+        || listen (fd, 64) != 0)
+      throw (std::runtime_error ((boost::format ("could not listen on %s: %s") % path % strerror (errno)).str()));
+    return fd;
+  }
+
+  inline int connectSocket (const std::string& path)
+  {
+    sockaddr_un addr = socketAddress (path);
+    int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+      throw (std::runtime_error ((boost::format ("could not create socket: %s") % strerror (errno)).str()));
+    if (connect (fd, (sockaddr*)&addr, sizeof(addr)) != 0)
+      throw (std::runtime_error ((boost::format ("could not connect to %s: %s") % path % strerror (errno)).str()));
+    return fd;
+  }
+
+}
+
+#endif  // CLUSTER_MODELPROTOCOL_H_
@@ -0,0 +1,202 @@
+#ifndef CLUSTER_POINTARENA_H_
+#define CLUSTER_POINTARENA_H_
+
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <stdint.h>
+#include <boost/format.hpp>
+
+namespace kmcluster
+{
+  /**
+   * Contiguous row major storage for the coordinates of a set of
+   * points of the same dimension, held as T.
+   *
+   * Rows are addressed by index, so the arena is free to grow by
+   * moving to a larger block; it grows geometrically and counts each
+   * time it does, so the cost of loading is visible next to the
+   * allocation free clustering loop that reads it.
+   *
+   * Instead of owning its rows, an arena can view rows of caller
+   * memory in place, see view.  It then allocates nothing and can not
+   * grow.
+   */
+  template <typename T>
+  class BasicPointArena
+  {
+  public:
+    BasicPointArena ()
+      : _coords()
+      , _base(0)
+      , _stride(0)
+      , _viewing(false)
+      , _dims(0)
+      , _rows(0)
+      , _capacity(0)
+      , _allocations(0)
+    { }
+
+    /**
+     * a copy owns a copy of the rows, or views the same caller memory
+     */
+    BasicPointArena (const BasicPointArena& other)
+      : _coords(other._coords)
+      , _base(other._base)
+      , _stride(other._stride)
+      , _viewing(other._viewing)
+      , _dims(other._dims)
+      , _rows(other._rows)
+      , _capacity(other._capacity)
+      , _allocations(other._allocations)
+    {
+      if (!_viewing)
+        _base = _coords.data();
+    }
+
+    BasicPointArena& operator= (const BasicPointArena& other)
+    {
+      if (this != &other)
+        {
+          _coords      = other._coords;
+          _viewing     = other._viewing;
+          _base        = _viewing ? other._base : _coords.data();
+          _stride      = other._stride;
+          _dims        = other._dims;
+          _rows        = other._rows;
+          _capacity    = other._capacity;
+          _allocations = other._allocations;
+        }
+      return *this;
+    }
+
+    /**
+     * read n rows of d coordinates in place, row i starting at
+     * x + i*stride.  Anything added before is dropped.
+     */
+    void view (const T* x, size_t n, size_t d, size_t stride)
+    {
+      std::vector<T>().swap (_coords);
+      _base     = x;
+      _stride   = stride;
+      _viewing  = true;
+      _dims     = d;
+      _rows     = n;
+      _capacity = n;
+    }
+
+    bool viewing () const
+    {
+      return _viewing;
+    }
+
+    /**
+     * copy a point into the arena, converting it to T, and return its
+     * row.  The first point fixes the dimension of the arena.
+     */
+    template <typename In>
+    size_t add (const In* x, size_t d)
+    {
+      if (_viewing)
+        throw (std::runtime_error ("can not add points to an arena viewing caller memory"));
+      if (_rows == 0 && d != _dims)
+        {
+          _dims = d;
+          _stride = d;
+          _coords.assign (_capacity*_dims, T());
+          _base = _coords.data();
+        }
+      if (d != _dims)
+        throw (std::runtime_error ((boost::format ("size mismatch: point of dimension %d added to arena of dimension %d")
+                                    % d % _dims).str()));
+      if (_rows == _capacity)
+        reserve (std::max<size_t> (2*_capacity, 1024));
+      std::copy (x, x+d, _coords.begin() + _rows*_dims);
+      return _rows++;
+    }
+
+    void reserve (size_t rows)
+    {
+      if (rows <= _capacity || _viewing)
+        return;
+      std::vector<T> block (rows * _dims);
+      std::copy (_coords.begin(), _coords.begin() + _rows*_dims, block.begin());
+      _coords.swap (block);
+      _base = _coords.data();
+      _stride = _dims;
+      _capacity = rows;
+      _allocations++;
+    }
+
+    const T* row (size_t i) const
+    {
+      return _base + i*_stride;
+    }
+
+    /**
+     * keep only rows order[0], order[1], ..., in that order: a
+     * permutation reorders the rows, a shorter list drops the rows
+     * missing from it.  Viewed rows are copied into a block of the
+     * arena's own, which is counted.
+     */
+    void gather (const std::vector<uint32_t>& order)
+    {
+      std::vector<T> block (order.size() * _dims);
+      for (size_t p=0; p<order.size(); p++)
+        std::copy (row (order[p]), row (order[p]) + _dims, block.begin() + p*_dims);
+      _coords.swap (block);
+      _base     = _coords.data();
+      _stride   = _dims;
+      _viewing  = false;
+      _rows     = order.size();
+      _capacity = _rows;
+      _allocations++;
+    }
+
+    const T& at (size_t i, size_t j) const
+    {
+      return row (i)[j];
+    }
+
+    /**
+     * distance in T between the starts of consecutive rows
+     */
+    size_t stride () const
+    {
+      return _stride;
+    }
+
+    size_t size () const
+    {
+      return _rows;
+    }
+
+    size_t dims () const
+    {
+      return _dims;
+    }
+
+    /**
+     * number of blocks the arena has allocated so far
+     */
+    uint64_t allocations () const
+    {
+      return _allocations;
+    }
+
+  private:
+    std::vector<T>      _coords;
+    const T*            _base;        // row 0, in _coords or in caller memory
+    size_t              _stride;
+    bool                _viewing;
+    size_t              _dims;
+    size_t              _rows;
+    size_t              _capacity;
+    uint64_t            _allocations;
+  };
+
+  typedef BasicPointArena<double> PointArena;
+
+}
+
+#endif  // CLUSTER_POINTARENA_H_
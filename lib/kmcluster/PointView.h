@@ -0,0 +1,65 @@
+#ifndef CLUSTER_POINTVIEW_H_
+#define CLUSTER_POINTVIEW_H_
+
+#include <cstddef>
+
+namespace kmcluster
+{
+  /**
+   * A non-owning view of n points of dimension d in caller memory.
+   * Coordinate j of point i is at
+   *
+   *   data[i*stride + j*dimStride]
+   *
+   * so one view type covers the common layouts:
+   *
+   *   row major            stride = d,     dimStride = 1
+   *   interleaved records  stride = width, dimStride = 1, with the
+   *                        coordinates at the start of each record
+   *   columnar             stride = 1,     dimStride = n
+   *
+   * Both strides count elements of T, not bytes.  The memory must
+   * outlive every clusterer built on the view and must not change
+   * while it clusters.
+   */
+  template <typename T>
+  struct BasicPointView
+  {
+    const T*  data;
+    size_t    n;
+    size_t    d;
+    size_t    stride;
+    size_t    dimStride;
+
+    /**
+     * a stride of 0 means rows of d packed coordinates
+     */
+    BasicPointView (const T* dataIn, size_t nIn, size_t dIn,
+                    size_t strideIn = 0, size_t dimStrideIn = 1)
+      : data (dataIn)
+      , n (nIn)
+      , d (dIn)
+      , stride (strideIn > 0 ? strideIn : dIn)
+      , dimStride (dimStrideIn)
+    { }
+
+    const T& at (size_t i, size_t j) const
+    {
+      return data[i*stride + j*dimStride];
+    }
+
+    /**
+     * true if the coordinates of each point are adjacent, so a point
+     * can be read in place as a row
+     */
+    bool rowContiguous () const
+    {
+      return dimStride == 1;
+    }
+  };
+
+  typedef BasicPointView<double> PointView;
+
+}
+
+#endif  // CLUSTER_POINTVIEW_H_
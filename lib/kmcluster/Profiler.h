@@ -0,0 +1,296 @@
+#ifndef CLUSTER_PROFILER_H_
+#define CLUSTER_PROFILER_H_
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <cstring>
+#include <chrono>
+#include <stdexcept>
+#include <stdint.h>
+#include <boost/format.hpp>
+#include <boost/lexical_cast.hpp>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace kmcluster
+{
+  /**
+   * Wall time and hardware counters per phase of a run.
+   *
+   * A phase is entered and left with begin and end, or with a
+   * ProfileScope.  Phases may nest; each one is charged everything
+   * that happens between its begin and end, including nested phases
+   * and the threads started inside it.  Phases are identified by
+   * their name, which must be a string literal.
+   *
+   * On Linux the cycles, instructions, cache misses and branch misses
+   * of the process are read through perf_event_open.  Counters the
+   * kernel refuses, for lack of a PMU or of permission, are reported
+   * as unavailable and cost nothing.
+   *
+   * Room for MAX_PHASES phases is reserved up front, so entering a
+   * phase inside the clustering loop does not allocate.
+   */
+  class Profiler
+  {
+  public:
+    enum { CYCLES, INSTRUCTIONS, CACHE_MISSES, BRANCH_MISSES, N_COUNTERS };
+
+    static const size_t MAX_PHASES = 32;
+
+    Profiler ()
+      : _phases ()
+      , _open ()
+      , _depth (0)
+      , _start (now ())
+    {
+      _phases.reserve (MAX_PHASES);
+      _open.reserve (MAX_PHASES);
+      for (size_t c=0; c<N_COUNTERS; c++)
+        _fd[c] = openCounter (c);
+    }
+
+    ~Profiler ()
+    {
+#ifdef __linux__
+      for (size_t c=0; c<N_COUNTERS; c++)
+        if (_fd[c] >= 0)
+          close (_fd[c]);
+#endif
+    }
+
+    /**
+     * true if the kernel granted counter c
+     */
+    bool hasCounter (size_t c) const
+    {
+      return _fd[c] >= 0;
+    }
+
+    void begin (const char* name)
+    {
+      if (_open.size() == MAX_PHASES)
+        throw (std::runtime_error ("profiler phases nested too deeply"));
+      OpenPhase o;
+      o.phase = find (name);
+      snapshot (o.start);
+      _open.push_back (o);
+      _depth++;
+    }
+
+    void end ()
+    {
+      if (_open.empty())
+        throw (std::runtime_error ("profiler end without begin"));
+      Sample stop;
+      snapshot (stop);
+      const OpenPhase& o = _open.back();
+      Phase& p = _phases[o.phase];
+      p.calls++;
+      p.total.seconds += stop.seconds - o.start.seconds;
+      for (size_t c=0; c<N_COUNTERS; c++)
+        p.total.counts[c] += stop.counts[c] - o.start.counts[c];
+      _open.pop_back ();
+      _depth--;
+    }
+
+    /**
+     * seconds since the profiler was created
+     */
+    double elapsed () const
+    {
+      return now () - _start;
+    }
+
+    /**
+     * one row per phase, in the order they were first entered, nested
+     * phases indented under their parent
+     */
+    std::string table () const
+    {
+      std::ostringstream out;
+      double total = elapsed ();
+      out << boost::format ("%-20s %6s %10s %6s %14s %14s %6s %12s %12s\n")
+        % "phase" % "calls" % "seconds" % "%" % "cycles" % "instructions"
+        % "ipc" % "cache-miss" % "branch-miss";
+      for (size_t i=0; i<_phases.size(); i++)
+        {
+          const Phase& p = _phases[i];
+          out << boost::format ("%-20s %6d %10.4f %6.1f %14s %14s %6s %12s %12s\n")
+            % (std::string (2*p.depth, ' ') + p.name) % p.calls % p.total.seconds
+            % (total > 0 ? 100*p.total.seconds/total : 0.0)
+            % counter (p, CYCLES) % counter (p, INSTRUCTIONS) % ipc (p)
+            % counter (p, CACHE_MISSES) % counter (p, BRANCH_MISSES);
+        }
+      out << boost::format ("%-20s %6s %10.4f\n") % "total" % "" % total;
+      if (!hasCounter (CYCLES))
+        out << "hardware counters unavailable\n";
+      return out.str();
+    }
+
+    /**
+     * the same as table, as a JSON object.  Unavailable counters are
+     * null.
+     */
+    std::string json () const
+    {
+      std::ostringstream out;
+      out << boost::format ("{\"seconds\": %.6f, \"phases\": [") % elapsed ();
+      for (size_t i=0; i<_phases.size(); i++)
+        {
+          const Phase& p = _phases[i];
+          out << (i > 0 ? ",\n  " : "\n  ")
+              << boost::format ("{\"name\": \"%s\", \"depth\": %d, \"calls\": %d, \"seconds\": %.6f, "
+                                "\"cycles\": %s, \"instructions\": %s, \"cache_misses\": %s, \"branch_misses\": %s}")
+            % p.name % p.depth % p.calls % p.total.seconds
+            % jsonCounter (p, CYCLES) % jsonCounter (p, INSTRUCTIONS)
+            % jsonCounter (p, CACHE_MISSES) % jsonCounter (p, BRANCH_MISSES);
+        }
+      out << "\n]}\n";
+      return out.str();
+    }
+
+  private:
+    struct Sample
+    {
+      double    seconds;
+      uint64_t  counts[N_COUNTERS];
+    };
+
+    struct Phase
+    {
+      const char*  name;
+      size_t       depth;
+      size_t       calls;
+      Sample       total;
+    };
+
+    struct OpenPhase
+    {
+      size_t    phase;
+      Sample    start;
+    };
+
+    std::vector<Phase>      _phases;
+    std::vector<OpenPhase>  _open;
+    size_t                  _depth;
+    double                  _start;
+    int                     _fd[N_COUNTERS];
+
+    static double now ()
+    {
+      return std::chrono::duration<double> (std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // a counter of this process and the threads it starts afterwards,
+    // in user space only so it works at the default paranoia level
+    static int openCounter (size_t counter)
+    {
+#ifdef __linux__
+      static const uint64_t configs[N_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES
+      };
+      struct perf_event_attr attr;
+      memset (&attr, 0, sizeof(attr));
+      attr.type           = PERF_TYPE_HARDWARE;
+      attr.size           = sizeof(attr);
+      attr.config         = configs[counter];
+      attr.exclude_kernel = 1;
+      attr.exclude_hv     = 1;
+      attr.inherit        = 1;
+      attr.read_format    = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+      return syscall (__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+      (void)counter;
+      return -1;
+#endif
+    }
+
+    size_t find (const char* name)
+    {
+      for (size_t i=0; i<_phases.size(); i++)
+        if (strcmp (_phases[i].name, name) == 0)
+          return i;
+      if (_phases.size() == MAX_PHASES)
+        throw (std::runtime_error ("too many profiler phases"));
+      Phase p;
+      memset (&p.total, 0, sizeof(p.total));
+      p.name  = name;
+      p.depth = _depth;
+      p.calls = 0;
+      _phases.push_back (p);
+      return _phases.size()-1;
+    }
+
+    // with more counters than the PMU has registers the kernel time
+    // shares them, so counts are scaled up by the share they ran
+    void snapshot (Sample& s) const
+    {
+      s.seconds = now ();
+      for (size_t c=0; c<N_COUNTERS; c++)
+        {
+          s.counts[c] = 0;
+#ifdef __linux__
+          uint64_t values[3];
+          if (_fd[c] >= 0 && read (_fd[c], values, sizeof(values)) == sizeof(values) && values[2] > 0)
+            s.counts[c] = (uint64_t)((double)values[0] * values[1] / values[2]);
+#endif
+        }
+    }
+
+    std::string counter (const Phase& p, size_t c) const
+    {
+      return hasCounter (c) ? boost::lexical_cast<std::string> (p.total.counts[c]) : "-";
+    }
+
+    std::string jsonCounter (const Phase& p, size_t c) const
+    {
+      return hasCounter (c) ? boost::lexical_cast<std::string> (p.total.counts[c]) : "null";
+    }
+
+    std::string ipc (const Phase& p) const
+    {
+      if (!hasCounter (CYCLES) || !hasCounter (INSTRUCTIONS) || p.total.counts[CYCLES] == 0)
+        return "-";
+      return (boost::format ("%.2f") % ((double)p.total.counts[INSTRUCTIONS] / p.total.counts[CYCLES])).str();
+    }
+  };
+
+  /**
+   * Enter a phase for the lifetime of the scope.  A null profiler
+   * makes it a no-op, so code can be instrumented unconditionally.
+   */
+  class ProfileScope
+  {
+  public:
+    ProfileScope (Profiler* profiler, const char* name)
+      : _profiler (profiler)
+    {
+      if (_profiler)
+        _profiler->begin (name);
+    }
+
+    ~ProfileScope ()
+    {
+      if (_profiler)
+        _profiler->end ();
+    }
+
+  private:
+    Profiler* _profiler;
+
+    ProfileScope (const ProfileScope&);
+    ProfileScope& operator= (const ProfileScope&);
+  };
+
+}
+
+#endif  // CLUSTER_PROFILER_H_
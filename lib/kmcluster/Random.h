@@ -0,0 +1,106 @@
+#ifndef CLUSTER_RANDOM_H_
+#define CLUSTER_RANDOM_H_
+
+#include <stdint.h>
+
+namespace kmcluster
+{
+  /**
+   * A seeded, counter based random number stream.
+   *
+   * The n-th number of a stream is the SplitMix64 finalizer applied to
+   * a key derived from (seed, stream) plus n times the golden gamma,
+   * so the whole state is the seed, the stream id and a draw counter.
+   * That makes it cheap to save in a checkpoint, to skip ahead with
+   * discard(), and to split into independent streams for workers:
+   * the same seed and the same splits always give the same numbers,
+   * whatever thread they are drawn on.
+   */
+  class RandomStream
+  {
+  public:
+    RandomStream (uint64_t seed = 1, uint64_t stream = 0)
+      : _seed (seed)
+      , _stream (stream)
+      , _key (deriveKey (seed, stream))
+      , _draws (0)
+    { }
+
+    void seed (uint64_t seed, uint64_t stream = 0)
+    {
+      _seed   = seed;
+      _stream = stream;
+      _key    = deriveKey (seed, stream);
+      _draws  = 0;
+    }
+
+    uint64_t getSeed () const
+    {
+      return _seed;
+    }
+
+    uint64_t getStream () const
+    {
+      return _stream;
+    }
+
+    /**
+     * the number of values drawn since the stream was seeded
+     */
+    uint64_t draws () const
+    {
+      return _draws;
+    }
+
+    void discard (uint64_t n)
+    {
+      _draws += n;
+    }
+
+    uint64_t next ()
+    {
+      return mix (_key + GOLDEN_GAMMA * ++_draws);
+    }
+
+    /**
+     * uniform in [0,d), with the full 53 bits of double resolution
+     */
+    double uniform (double d = 1.0)
+    {
+      return (next () >> 11) * (1.0/9007199254740992.0) * d;
+    }
+
+    /**
+     * an independent stream for worker `stream`.  The child is keyed
+     * by the next value of this stream, so repeated splits with the
+     * same id still give different children.
+     */
+    RandomStream split (uint64_t stream)
+    {
+      return RandomStream (next (), stream);
+    }
+
+  private:
+    static const uint64_t GOLDEN_GAMMA = 0x9e3779b97f4a7c15ULL;
+
+    uint64_t _seed;
+    uint64_t _stream;
+    uint64_t _key;
+    uint64_t _draws;
+
+    static uint64_t mix (uint64_t z)
+    {
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+      return z ^ (z >> 31);
+    }
+
+    static uint64_t deriveKey (uint64_t seed, uint64_t stream)
+    {
+      return mix (mix (seed) ^ mix (stream + GOLDEN_GAMMA));
+    }
+  };
+
+}
+
+#endif  // CLUSTER_RANDOM_H_
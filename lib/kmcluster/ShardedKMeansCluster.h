@@ -0,0 +1,732 @@
+#ifndef CLUSTER_SHARDED_KMEANSCLUSTER_H_
+#define CLUSTER_SHARDED_KMEANSCLUSTER_H_
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <numeric>
+#include <unistd.h>
+#include <sched.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <boost/format.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/algorithm/string.hpp>
+#include "KMeansCluster.h"
+#include "Random.h"
+#include "Profiler.h"
+
+namespace kmcluster
+{
+  /**
+   * KMeans++ clustering of a file too large for one process.
+   *
+   * The file is split into byte ranges on line boundaries and each
+   * range is loaded by its own worker process, so no process ever
+   * holds more than its shard.  The calling process coordinates over
+   * a pair of pipes per worker: for seeding it asks the workers for
+   * their total seeding weight and has the owning worker return the
+   * picked point, and on each iteration it broadcasts the centers and
+   * reduces the per shard centroid sums and masses into new centers.
+   *
+   * Workers can be pinned to NUMA nodes round robin; each worker
+   * loads its shard after it is pinned, so its points are allocated
+   * on the local node.
+   */
+  class ShardedKMeansClusterND : boost::noncopyable
+  {
+  public:
+    typedef boost::function<bool (const std::string&, PointND&)> parser_t;
+
+    ShardedKMeansClusterND (size_t nClusters, size_t nShards)
+      : _workers()
+      , _centers()
+      , _spread()
+      , _mass()
+      , _nClusters (nClusters)
+      , _nShards (nShards > 0 ? nShards : 1)
+      , _nDims (0)
+      , _nPoints (0)
+      , _numaPinning (false)
+      , _maxIterations (0)
+      , _random ()
+      , _profiler (0)
+    { }
+
+    ~ShardedKMeansClusterND ()
+    {
+      stopWorkers ();
+    }
+
+    /**
+     * stop iterating after n iterations even if points still move,
+     * with a warning; 0, the default, iterates until no point moves
+     */
+    void setMaxIterations (int n)
+    {
+      _maxIterations = n;
+    }
+
+    /**
+     * reseed the random stream used to pick the initial centers
+     */
+    void setSeed (uint64_t seed)
+    {
+      _random.seed (seed);
+    }
+
+    /**
+     * pin shard i to the cpus of NUMA node i modulo the number of nodes
+     */
+    void setNumaPinning (bool pin)
+    {
+      _numaPinning = pin;
+    }
+
+    /**
+     * record the load phase, from starting the workers until every
+     * shard is read, in profiler.  Null turns profiling off.
+     */
+    void setProfiler (Profiler* profiler)
+    {
+      _profiler = profiler;
+    }
+
+    /**
+     * cluster the points of fname, parser turns a line of the file
+     * into a point and returns false for lines holding no point
+     */
+    std::vector<PointND> cluster (const std::string& fname, parser_t parser)
+    {
+      {
+        ProfileScope scope (_profiler, "load");
+        startWorkers (fname, parser);
+      }
+
+      // select initial seeds for clusters
+      _centers.clear ();
+      for (size_t i=0; i<_nClusters; i++)
+        {
+          std::vector<double> totals = weightDataPoints ();
+          selectClusterCenter (totals);
+        }
+
+      KMeansCluster ();
+      collectSpread ();
+      stopWorkers ();
+      return _centers;
+    }
+
+    size_t size () const
+    {
+      return _nPoints;
+    }
+
+    std::string str() const
+    {
+      std::string out;
+      for (size_t i=0; i<_centers.size(); i++)
+        out += _centers[i].str() + "\n";
+      return out;
+    }
+
+    /**
+     * the spread, size and center of every cluster.  The points stay
+     * with the workers, so unlike KMeansClusterND::clusterSets they are
+     * not listed.
+     */
+    std::string clusterSets () const
+    {
+      double totalSpread = 0.0;
+      std::string ret;
+      for (size_t c=0; c<_centers.size(); c++)
+        {
+          double spread = _mass[c] > 0 ? _spread[c]/_mass[c] : 0.0;
+          totalSpread += spread;
+          ret += (boost::format("cluster %d spread %f size %.0f\n%s\n\n")
+                  % c % spread % _mass[c] % _centers[c].str()).str();
+        }
+      return (boost::format("total spread: %f\n") % totalSpread).str() + ret;
+    }
+
+  private:
+
+    enum Command
+      {
+        CMD_SEED_WEIGHT,  // first flag, dims, center; reply total seeding weight
+        CMD_SEED_PICK,    // pick follows, reply the picked point
+        CMD_ASSIGN,       // count and centers; reply changed, sums, masses
+        CMD_SPREAD,       // count and centers; reply distance sums and masses per cluster
+        CMD_EXIT
+      };
+
+    struct Worker
+    {
+      pid_t  pid;
+      int    toWorker;
+      int    fromWorker;
+      size_t nPoints;
+    };
+
+    //
+    // private data
+    //
+
+    std::vector<Worker>      _workers;
+    std::vector<PointND>     _centers;
+    std::vector<double>      _spread;
+    std::vector<double>      _mass;
+    size_t                   _nClusters;
+    size_t                   _nShards;
+    size_t                   _nDims;
+    size_t                   _nPoints;
+    bool                     _numaPinning;
+    int                      _maxIterations;  // 0 for no limit
+    RandomStream             _random;
+    Profiler*                _profiler;       // not owned, may be null
+
+    //
+    // pipe helpers, shared by both sides
+    //
+
+    static void writeAll (int fd, const void* buf, size_t n)
+    {
+      const char* p = static_cast<const char*>(buf);
+      while (n > 0)
+        {
+          ssize_t w = ::write (fd, p, n);
+          if (w < 0 && errno == EINTR)
+            continue;
+          if (w <= 0)
+            throw (std::runtime_error ((boost::format ("shard pipe write failed: %s") % strerror (errno)).str()));
+          p += w;
+          n -= w;
+        }
+    }
+
+    static void readAll (int fd, void* buf, size_t n)
+    {
+      char* p = static_cast<char*>(buf);
+      while (n > 0)
+        {
+          ssize_t r = ::read (fd, p, n);
+          if (r < 0 && errno == EINTR)
+            continue;
+          if (r <= 0)
+            throw (std::runtime_error ("shard pipe closed, a worker exited early"));
+          p += r;
+          n -= r;
+        }
+    }
+
+    static void writeDoubles (int fd, const std::vector<double>& v)
+    {
+      if (v.size() > 0)
+        writeAll (fd, &v[0], v.size()*sizeof(double));
+    }
+
+    static void readDoubles (int fd, std::vector<double>& v)
+    {
+      if (v.size() > 0)
+        readAll (fd, &v[0], v.size()*sizeof(double));
+    }
+
+    static void sendCommand (int fd, Command cmd)
+    {
+      int c = cmd;
+      writeAll (fd, &c, sizeof(c));
+    }
+
+    //
+    // coordinator
+    //
+
+    void startWorkers (const std::string& fname, parser_t parser)
+    {
+      struct stat st;
+      if (stat (fname.c_str(), &st) != 0)
+        throw (std::runtime_error ("could not open file: " + fname));
+      off_t fileSize = st.st_size;
+
+      std::vector<std::vector<int> > nodeCpus;
+      if (_numaPinning)
+        nodeCpus = numaNodeCpus ();
+
+      for (size_t s=0; s<_nShards; s++)
+        {
+          int down[2], up[2];
+          if (pipe (down) != 0 || pipe (up) != 0)
+            throw (std::runtime_error ("could not create shard pipes"));
+
+          off_t begin = fileSize * s / _nShards;
+          off_t end   = fileSize * (s+1) / _nShards;
+
+          pid_t pid = fork ();
+          if (pid < 0)
+            throw (std::runtime_error ("could not fork shard worker"));
+          if (pid == 0)
+            {
+              close (down[1]);
+              close (up[0]);
+              for (size_t i=0; i<_workers.size(); i++)
+                {
+                  close (_workers[i].toWorker);
+                  close (_workers[i].fromWorker);
+                }
+              int status = 0;
+              try
+                {
+                  if (!nodeCpus.empty())
+                    pinToCpus (nodeCpus[s % nodeCpus.size()]);
+                  Shard shard;
+                  shard.load (fname, begin, end, parser);
+                  shard.serve (down[0], up[1]);
+                }
+              catch (std::exception& e)
+                {
+                  std::cerr << "shard " << s << ": " << e.what() << std::endl;
+                  status = 1;
+                }
+              _exit (status);
+            }
+
+          close (down[0]);
+          close (up[1]);
+          Worker w;
+          w.pid        = pid;
+          w.toWorker   = down[1];
+          w.fromWorker = up[0];
+          w.nPoints    = 0;
+          _workers.push_back (w);
+        }
+
+      // each worker reports its point count and dimension once loaded
+      _nPoints = 0;
+      _nDims   = 0;
+      for (size_t s=0; s<_workers.size(); s++)
+        {
+          size_t hello[2];
+          readAll (_workers[s].fromWorker, hello, sizeof(hello));
+          _workers[s].nPoints = hello[0];
+          _nPoints += hello[0];
+          if (hello[0] == 0)
+            continue;
+          if (_nDims != 0 && hello[1] != _nDims)
+            throw (std::runtime_error ((boost::format ("shard %d has %d dimensions, expected %d")
+                                        % s % hello[1] % _nDims).str()));
+          _nDims = hello[1];
+        }
+      if (_nPoints == 0)
+        throw (std::runtime_error ("no points in file: " + fname));
+    }
+
+    void stopWorkers ()
+    {
+      if (_workers.empty())
+        return;
+
+      // a worker may already be gone, don't die on its pipe: block
+      // SIGPIPE on this thread for the writes and discard what they
+      // raise, leaving the process's signal handling as it was
+      sigset_t pipeSet, oldMask, pending;
+      sigemptyset (&pipeSet);
+      sigaddset (&pipeSet, SIGPIPE);
+      sigpending (&pending);
+      bool wasPending = sigismember (&pending, SIGPIPE);
+      pthread_sigmask (SIG_BLOCK, &pipeSet, &oldMask);
+      for (size_t s=0; s<_workers.size(); s++)
+        {
+          int c = CMD_EXIT;
+          ::write (_workers[s].toWorker, &c, sizeof(c));
+          close (_workers[s].toWorker);
+          close (_workers[s].fromWorker);
+          int status;
+          waitpid (_workers[s].pid, &status, 0);
+        }
+      if (!wasPending)
+        {
+          timespec zero = { 0, 0 };
+          while (sigtimedwait (&pipeSet, 0, &zero) == SIGPIPE)
+            ;
+        }
+      pthread_sigmask (SIG_SETMASK, &oldMask, 0);
+      _workers.clear ();
+    }
+
+    // update the seeding weights for the newest center, returns the
+    // total weight of each shard
+    std::vector<double> weightDataPoints ()
+    {
+      PointND newest;
+      if (_centers.size() > 0)
+        newest = _centers.back();
+      std::vector<double> center (_nDims, 0.0);
+      std::copy (newest.x.begin(), newest.x.end(), center.begin());
+      int first = _centers.size() == 0;
+
+      for (size_t s=0; s<_workers.size(); s++)
+        {
+          sendCommand (_workers[s].toWorker, CMD_SEED_WEIGHT);
+          writeAll (_workers[s].toWorker, &first, sizeof(first));
+          writeAll (_workers[s].toWorker, &_nDims, sizeof(_nDims));
+          writeDoubles (_workers[s].toWorker, center);
+        }
+
+      std::vector<double> totals (_workers.size());
+      for (size_t s=0; s<_workers.size(); s++)
+        readAll (_workers[s].fromWorker, &totals[s], sizeof(double));
+      return totals;
+    }
+
+    void selectClusterCenter (const std::vector<double>& totals)
+    {
+      double total = std::accumulate (totals.begin(), totals.end(), 0.0);
+      double pick  = randomDouble (total);
+      size_t s = 0;
+      for (; s+1<_workers.size(); s++)
+        {
+          if (totals[s] > pick)
+            break;
+          pick -= totals[s];
+        }
+      // skip shards that hold no points at all
+      while (_workers[s].nPoints == 0 && s > 0)
+        s--;
+
+      sendCommand (_workers[s].toWorker, CMD_SEED_PICK);
+      writeAll (_workers[s].toWorker, &pick, sizeof(pick));
+      std::vector<double> center (_nDims);
+      readDoubles (_workers[s].fromWorker, center);
+      _centers.push_back (PointND (center));
+    }
+
+    void KMeansCluster ()
+    {
+      size_t k = _centers.size();
+      std::vector<double> centers (k*_nDims);
+      std::vector<double> sums (k*_nDims);
+      std::vector<double> mass (k);
+      std::vector<double> totalSums (k*_nDims);
+      std::vector<double> totalMass (k);
+
+      int iterations = 0;
+      bool changed = true;
+      while (changed)
+        {
+          for (size_t c=0; c<k; c++)
+            std::copy (_centers[c].x.begin(), _centers[c].x.end(), centers.begin() + c*_nDims);
+
+          for (size_t s=0; s<_workers.size(); s++)
+            {
+              sendCommand (_workers[s].toWorker, CMD_ASSIGN);
+              writeAll (_workers[s].toWorker, &k, sizeof(k));
+              writeDoubles (_workers[s].toWorker, centers);
+            }
+
+          size_t del = 0;
+          std::fill (totalSums.begin(), totalSums.end(), 0.0);
+          std::fill (totalMass.begin(), totalMass.end(), 0.0);
+          for (size_t s=0; s<_workers.size(); s++)
+            {
+              size_t shardDel;
+              readAll (_workers[s].fromWorker, &shardDel, sizeof(shardDel));
+              readDoubles (_workers[s].fromWorker, sums);
+              readDoubles (_workers[s].fromWorker, mass);
+              del += shardDel;
+              for (size_t j=0; j<sums.size(); j++)
+                totalSums[j] += sums[j];
+              for (size_t c=0; c<k; c++)
+                totalMass[c] += mass[c];
+            }
+
+          for (size_t c=0; c<k; c++)
+            for (size_t j=0; j<_nDims; j++)
+              _centers[c].x[j] = totalMass[c] > 0 ? totalSums[c*_nDims+j] / totalMass[c] : 0.5;
+
+          changed = del > 0;
+          if (++iterations >= _maxIterations && _maxIterations > 0 && changed)
+            {
+              std::cerr << boost::format ("stopped after %d iterations with %d points still moving\n")
+                % iterations % del;
+              changed = false;
+            }
+        }
+    }
+
+    void collectSpread ()
+    {
+      size_t k = _centers.size();
+      std::vector<double> spread (k), mass (k);
+      _spread.assign (k, 0.0);
+      _mass.assign (k, 0.0);
+      // the spreads are measured against the final centers, not those
+      // of the last assignment
+      std::vector<double> centers (k*_nDims);
+      for (size_t c=0; c<k; c++)
+        std::copy (_centers[c].x.begin(), _centers[c].x.end(), centers.begin() + c*_nDims);
+      for (size_t s=0; s<_workers.size(); s++)
+        {
+          sendCommand (_workers[s].toWorker, CMD_SPREAD);
+          writeAll (_workers[s].toWorker, &k, sizeof(k));
+          writeDoubles (_workers[s].toWorker, centers);
+        }
+      for (size_t s=0; s<_workers.size(); s++)
+        {
+          readDoubles (_workers[s].fromWorker, spread);
+          readDoubles (_workers[s].fromWorker, mass);
+          for (size_t c=0; c<k; c++)
+            {
+              _spread[c] += spread[c];
+              _mass[c]   += mass[c];
+            }
+        }
+    }
+
+    double randomDouble (double d)
+    {
+      return _random.uniform (d);
+    }
+
+    //
+    // NUMA placement
+    //
+
+    // the cpus of every NUMA node, read from sysfs
+    static std::vector<std::vector<int> > numaNodeCpus ()
+    {
+      std::vector<std::vector<int> > nodes;
+      for (int node=0; ; node++)
+        {
+          std::ifstream fin ((boost::format ("/sys/devices/system/node/node%d/cpulist") % node).str().c_str());
+          if (!fin)
+            break;
+          std::string line;
+          getline (fin, line);
+          boost::trim (line);
+
+          std::vector<std::string> ranges;
+          std::vector<int> cpus;
+          boost::split (ranges, line, boost::is_any_of(","));
+          for (size_t i=0; i<ranges.size(); i++)
+            {
+              if (ranges[i].empty())
+                continue;
+              int lo, hi;
+              if (sscanf (ranges[i].c_str(), "%d-%d", &lo, &hi) != 2)
+                hi = lo = atoi (ranges[i].c_str());
+              for (int c=lo; c<=hi; c++)
+                cpus.push_back (c);
+            }
+          if (!cpus.empty())
+            nodes.push_back (cpus);
+        }
+      return nodes;
+    }
+
+    static void pinToCpus (const std::vector<int>& cpus)
+    {
+      cpu_set_t set;
+      CPU_ZERO (&set);
+      for (size_t i=0; i<cpus.size(); i++)
+        CPU_SET (cpus[i], &set);
+      if (sched_setaffinity (0, sizeof(set), &set) != 0)
+        std::cerr << "could not pin shard to its NUMA node: " << strerror (errno) << std::endl;
+    }
+
+    //
+    // private class
+    //
+
+    // the worker side, holding one shard of the points
+    class Shard
+    {
+    public:
+      Shard ()
+        : _points()
+        , _weight()
+        , _clusterid()
+        , _centers()
+        , _nDims (0)
+      { }
+
+      // load the lines starting in [begin, end), a line straddling
+      // begin belongs to the previous shard
+      void load (const std::string& fname, off_t begin, off_t end, parser_t parser)
+      {
+        std::ifstream fin (fname.c_str());
+        if (!fin)
+          throw (std::runtime_error ("could not open file: " + fname));
+
+        std::string line;
+        if (begin > 0)
+          {
+            fin.seekg (begin-1);
+            if (fin.get() != '\n')
+              getline (fin, line);
+          }
+
+        PointND p;
+        while (fin && (off_t)fin.tellg() < end && getline (fin, line))
+          {
+            if (!parser (line, p))
+              continue;
+            if (_nDims == 0)
+              _nDims = p.x.size();
+            if (p.x.size() != _nDims)
+              throw (std::runtime_error ((boost::format ("point with %d dimensions, expected %d: %s")
+                                          % p.x.size() % _nDims % line).str()));
+            _points.push_back (p);
+          }
+        _weight.assign (_points.size(), 0.0);
+        _clusterid.assign (_points.size(), -1);
+      }
+
+      void serve (int in, int out)
+      {
+        size_t hello[2] = { _points.size(), _nDims };
+        writeAll (out, hello, sizeof(hello));
+
+        for (;;)
+          {
+            int cmd;
+            readAll (in, &cmd, sizeof(cmd));
+            switch (cmd)
+              {
+              case CMD_SEED_WEIGHT: seedWeight (in, out); break;
+              case CMD_SEED_PICK:   seedPick (in, out);   break;
+              case CMD_ASSIGN:      assign (in, out);     break;
+              case CMD_SPREAD:      spread (in, out);     break;
+              default:              return;
+              }
+          }
+      }
+
+    private:
+      std::vector<PointND> _points;
+      std::vector<double>  _weight;
+      std::vector<int>     _clusterid;
+      std::vector<PointND> _centers;
+      size_t               _nDims;
+
+      void seedWeight (int in, int out)
+      {
+        int first;
+        readAll (in, &first, sizeof(first));
+        // an empty shard learns the dimension from the coordinator
+        readAll (in, &_nDims, sizeof(_nDims));
+        std::vector<double> center (_nDims);
+        readDoubles (in, center);
+
+        PointND c (center);
+        double total = 0.0;
+        for (size_t i=0; i<_points.size(); i++)
+          {
+            if (first)
+              _weight[i] = 1;
+            else
+              {
+                double dmetric = _points[i].distance (c);
+                if (_weight[i] > dmetric)
+                  _weight[i] = dmetric;
+              }
+            total += _weight[i];
+          }
+        writeAll (out, &total, sizeof(total));
+      }
+
+      void seedPick (int in, int out)
+      {
+        double pick;
+        readAll (in, &pick, sizeof(pick));
+        double running = 0.0;
+        size_t i = 0;
+        for (; i+1<_points.size(); i++)
+          {
+            if (running + _weight[i] > pick)
+              break;
+            running += _weight[i];
+          }
+        writeDoubles (out, _points[i].x);
+      }
+
+      // a center count and the centers, row major
+      void readCenters (int in)
+      {
+        size_t k;
+        readAll (in, &k, sizeof(k));
+        std::vector<double> centers (k*_nDims);
+        readDoubles (in, centers);
+        _centers.resize (k);
+        for (size_t c=0; c<k; c++)
+          _centers[c].x.assign (centers.begin() + c*_nDims, centers.begin() + (c+1)*_nDims);
+      }
+
+      void assign (int in, int out)
+      {
+        readCenters (in);
+        size_t k = _centers.size();
+        size_t del = 0;
+        std::vector<double> sums (k*_nDims, 0.0);
+        std::vector<double> mass (k, 0.0);
+        for (size_t i=0; i<_points.size(); i++)
+          {
+            int c = getNearestCluster (_points[i]);
+            if (c != _clusterid[i])
+              {
+                _clusterid[i] = c;
+                del++;
+              }
+            for (size_t j=0; j<_nDims; j++)
+              sums[c*_nDims+j] += _points[i].x[j];
+            mass[c] += 1;
+          }
+        writeAll (out, &del, sizeof(del));
+        writeDoubles (out, sums);
+        writeDoubles (out, mass);
+      }
+
+      void spread (int in, int out)
+      {
+        readCenters (in);
+        size_t k = _centers.size();
+        std::vector<double> spread (k, 0.0);
+        std::vector<double> mass (k, 0.0);
+        for (size_t i=0; i<_points.size(); i++)
+          {
+            int c = _clusterid[i];
+            spread[c] += _points[i].distance (_centers[c]);
+            mass[c]   += 1;
+          }
+        writeDoubles (out, spread);
+        writeDoubles (out, mass);
+      }
+
+      int getNearestCluster (const PointND& p) const
+      {
+        int    closest  = 0;
+        double distance = _centers[0].distance (p);
+        for (size_t i=1; i<_centers.size(); i++)
+          {
+            double d = _centers[i].distance (p);
+            if (d < distance)
+              {
+                distance = d;
+                closest = i;
+              }
+          }
+        return closest;
+      }
+    };
+  };
+
+}
+
+#endif  // CLUSTER_SHARDED_KMEANSCLUSTER_H_
@@ -0,0 +1,130 @@
+#ifndef CLUSTER_SPACEFILLINGCURVE_H_
+#define CLUSTER_SPACEFILLINGCURVE_H_
+
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <stdint.h>
+
+namespace kmcluster
+{
+  //
+  // Keys along a space filling curve, so that sorting points by key
+  // puts points that are near in space near in memory.
+  //
+  // Each coordinate is quantized to the bits of its share of a 64 bit
+  // key, between the minimum and maximum of that coordinate.  A 64 bit
+  // key has room for few dimensions at any useful resolution, so for
+  // points of more than MAX_CURVE_DIMS dimensions the key is built from
+  // the MAX_CURVE_DIMS coordinates with the widest range.
+  //
+
+  static const size_t MAX_CURVE_DIMS = 8;
+
+  /**
+   * the Morton (Z order) key: the bits of the quantized coordinates,
+   * interleaved from the most significant down
+   */
+  inline uint64_t mortonKey (const uint32_t* x, size_t dims, size_t bits)
+  {
+    uint64_t key = 0;
+    for (size_t b=bits; b-- > 0; )
+      for (size_t j=0; j<dims; j++)
+        key = (key << 1) | ((x[j] >> b) & 1);
+    return key;
+  }
+
+  /**
+   * the Hilbert key, by Skilling's transform of the coordinates into
+   * the transposed Hilbert index ("Programming the Hilbert curve",
+   * 2004), interleaved like a Morton key.  Unlike the Z order the curve
+   * never jumps, so consecutive keys are always adjacent cells.
+   * x is overwritten.
+   */
+  inline uint64_t hilbertKey (uint32_t* x, size_t dims, size_t bits)
+  {
+    uint32_t m = 1u << (bits-1);
+
+    // inverse undo
+    for (uint32_t q=m; q>1; q>>=1)
+      {
+        uint32_t p = q-1;
+        for (size_t j=0; j<dims; j++)
+          if (x[j] & q)
+            x[0] ^= p;
+          else
+            {
+              uint32_t t = (x[0] ^ x[j]) & p;
+              x[0] ^= t;
+              x[j] ^= t;
+            }
+      }
+
+    // gray encode
+    for (size_t j=1; j<dims; j++)
+      x[j] ^= x[j-1];
+    uint32_t t = 0;
+    for (uint32_t q=m; q>1; q>>=1)
+      if (x[dims-1] & q)
+        t ^= q-1;
+    for (size_t j=0; j<dims; j++)
+      x[j] ^= t;
+
+    return mortonKey (x, dims, bits);
+  }
+
+  /**
+   * the permutation that sorts the n rows of points by their key along
+   * the Morton curve, or the Hilbert curve if hilbert is set: order[p]
+   * is the row that goes to position p.  Rows is anything with
+   * row (i) returning a pointer to d coordinates.
+   */
+  template <typename Rows>
+  void curveOrder (const Rows& points, size_t n, size_t d, bool hilbert, std::vector<uint32_t>& order)
+  {
+    order.resize (n);
+    for (size_t i=0; i<n; i++)
+      order[i] = i;
+    if (n == 0 || d == 0)
+      return;
+
+    std::vector<double> lo (d, std::numeric_limits<double>::infinity());
+    std::vector<double> hi (d, -std::numeric_limits<double>::infinity());
+    for (size_t i=0; i<n; i++)
+      for (size_t j=0; j<d; j++)
+        {
+          double v = points.row (i)[j];
+          lo[j] = std::min (lo[j], v);
+          hi[j] = std::max (hi[j], v);
+        }
+
+    // the widest coordinates
+    std::vector<std::pair<double,size_t> > ranges (d);
+    for (size_t j=0; j<d; j++)
+      ranges[j] = std::make_pair (lo[j]-hi[j], j);
+    size_t dims = std::min (d, MAX_CURVE_DIMS);
+    std::partial_sort (ranges.begin(), ranges.begin()+dims, ranges.end());
+
+    size_t bits = std::min<size_t> (64 / dims, 32);
+    double cells = (double)(bits == 32 ? 0xffffffffu : (1u << bits) - 1);
+    std::vector<std::pair<uint64_t,uint32_t> > keys (n);
+    std::vector<uint32_t> x (dims);
+    for (size_t i=0; i<n; i++)
+      {
+        for (size_t k=0; k<dims; k++)
+          {
+            size_t j = ranges[k].second;
+            double width = hi[j]-lo[j];
+            x[k] = width > 0 ? (uint32_t)((points.row (i)[j]-lo[j]) / width * cells) : 0;
+          }
+        uint64_t key = hilbert ? hilbertKey (x.data(), dims, bits) : mortonKey (x.data(), dims, bits);
+        keys[i] = std::make_pair (key, (uint32_t)i);
+      }
+    std::sort (keys.begin(), keys.end());
+    for (size_t i=0; i<n; i++)
+      order[i] = keys[i].second;
+  }
+
+}
+
+#endif  // CLUSTER_SPACEFILLINGCURVE_H_
@@ -0,0 +1,154 @@
+#ifndef CLUSTER_SPARSEMATRIX_H_
+#define CLUSTER_SPARSEMATRIX_H_
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
+#include <boost/format.hpp>
+
+namespace kmcluster
+{
+  typedef std::pair<unsigned int,double> sparse_entry_t;
+
+  /**
+   * Compressed sparse row storage for a set of points.
+   *
+   * Row i owns the entries [_rowStart[i], _rowStart[i+1]) of the
+   * column and value arrays, so memory is proportional to the number
+   * of nonzeros rather than rows times columns.  The squared norm of
+   * every row is computed once on insertion since the distance
+   * kernels need it on every iteration.
+   */
+  class SparseMatrix
+  {
+  public:
+    SparseMatrix ()
+      : _rowStart(1, 0)
+      , _columns()
+      , _values()
+      , _norms()
+      , _labels()
+      , _nColumns(0)
+    { }
+
+    /**
+     * append a row, the entries may be given in any order but a
+     * column may only appear once.  Explicit zeros are dropped.
+     */
+    void addRow (const std::string& label, std::vector<sparse_entry_t> entries)
+    {
+      std::sort (entries.begin(), entries.end());
+      double norm = 0.0;
+      for (size_t i=0; i<entries.size(); i++)
+        {
+          if (i > 0 && entries[i].first == entries[i-1].first)
+            throw (std::runtime_error ((boost::format ("duplicate column %d in row %d")
+                                        % entries[i].first % rows()).str()));
+          if (entries[i].second == 0)
+            continue;
+          _columns.push_back (entries[i].first);
+          _values.push_back (entries[i].second);
+          norm += entries[i].second * entries[i].second;
+          if (entries[i].first >= _nColumns)
+            _nColumns = entries[i].first + 1;
+        }
+      _rowStart.push_back (_columns.size());
+      _norms.push_back (norm);
+      _labels.push_back (label);
+    }
+
+    size_t rows () const
+    {
+      return _norms.size();
+    }
+
+    size_t columns () const
+    {
+      return _nColumns;
+    }
+
+    size_t nonZeros () const
+    {
+      return _values.size();
+    }
+
+    size_t rowSize (size_t row) const
+    {
+      return _rowStart[row+1] - _rowStart[row];
+    }
+
+    const unsigned int* rowColumns (size_t row) const
+    {
+      return _columns.data() + _rowStart[row];
+    }
+
+    const double* rowValues (size_t row) const
+    {
+      return _values.data() + _rowStart[row];
+    }
+
+    double squaredNorm (size_t row) const
+    {
+      return _norms[row];
+    }
+
+    const std::string& label (size_t row) const
+    {
+      return _labels[row];
+    }
+
+    /**
+     * dot product of a row with a dense vector of columns() entries
+     */
+    double dot (size_t row, const double* dense) const
+    {
+      const unsigned int* col = rowColumns (row);
+      const double*       val = rowValues (row);
+      size_t n = rowSize (row);
+      double sum = 0.0;
+      for (size_t i=0; i<n; i++)
+        sum += val[i] * dense[col[i]];
+      return sum;
+    }
+
+    /**
+     * add weight times a row to a dense vector of columns() entries
+     */
+    void addTo (size_t row, double* dense, double weight = 1.0) const
+    {
+      const unsigned int* col = rowColumns (row);
+      const double*       val = rowValues (row);
+      size_t n = rowSize (row);
+      for (size_t i=0; i<n; i++)
+        dense[col[i]] += weight * val[i];
+    }
+
+    /**
+     * the row in the same label,column:value format it was read from
+     */
+    std::string rowStr (size_t row) const
+    {
+      std::string out;
+      if (_labels[row].size() > 0)
+        out += _labels[row] + ",";
+      const unsigned int* col = rowColumns (row);
+      const double*       val = rowValues (row);
+      for (size_t i=0; i<rowSize (row); i++)
+        out += boost::str (boost::format("%d:%.12f,") % col[i] % val[i]);
+      return out;
+    }
+
+  private:
+    std::vector<size_t>       _rowStart;
+    std::vector<unsigned int> _columns;
+    std::vector<double>       _values;
+    std::vector<double>       _norms;
+    std::vector<std::string>  _labels;
+    size_t                    _nColumns;
+  };
+
+}
+
+#endif  // CLUSTER_SPARSEMATRIX_H_
@@ -0,0 +1,57 @@
+#ifndef CLUSTER_STRINGPOOL_H_
+#define CLUSTER_STRINGPOOL_H_
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <boost/unordered_map.hpp>
+
+namespace kmcluster
+{
+  /**
+   * Interns strings, so that each distinct label is stored once and
+   * points refer to it by a small integer id.  Id 0 is always the
+   * empty string.
+   */
+  class StringPool
+  {
+  public:
+    StringPool ()
+      : _strings(1)
+      , _index()
+    {
+      _index[_strings[0]] = 0;
+    }
+
+    uint32_t intern (const std::string& s)
+    {
+      boost::unordered_map<std::string,uint32_t>::const_iterator i = _index.find (s);
+      if (i != _index.end())
+        return i->second;
+      uint32_t id = _strings.size();
+      _strings.push_back (s);
+      _index[s] = id;
+      return id;
+    }
+
+    const std::string& str (uint32_t id) const
+    {
+      return _strings[id];
+    }
+
+    /**
+     * number of distinct strings, including the empty one
+     */
+    size_t size () const
+    {
+      return _strings.size();
+    }
+
+  private:
+    std::vector<std::string>                    _strings;
+    boost::unordered_map<std::string,uint32_t>  _index;
+  };
+
+}
+
+#endif  // CLUSTER_STRINGPOOL_H_
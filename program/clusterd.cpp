@@ -0,0 +1,330 @@
+#include <iostream>
+#include <string>
+#include <fstream>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/format.hpp>
+#include <kmcluster/KMeansCluster.h>
+#include <kmcluster/CentroidModel.h>
+#include <kmcluster/ModelProtocol.h>
+#include "parsers.h"
+
+// clusterd holds a model of centers in memory and answers batched
+// nearest center queries over a Unix domain socket, in the binary
+// format of ModelProtocol.h, so callers pay neither process startup
+// nor parsing nor clustering per request.
+//
+// compile:  g++ -O2 -pthread clusterd.cpp -I../lib/ -o clusterd
+//
+//   ./clusterd /tmp/kmcluster.sock --model points.model
+//   ./clusterd /tmp/kmcluster.sock --train points.csv 50 --seed 42 --threads 8
+//   ./clusterd /tmp/kmcluster.sock --train points.csv 50 --metric manhattan
+//
+// A model is served with the metric it was found with: the one named
+// in a model file, or --metric when training.  Reloads must keep it.
+//
+// RELOAD trusts its caller: the server reads and trains on whatever
+// file a client names, with the server's own permissions.  The socket
+// is therefore created owner-only (0600); anyone who can connect to it
+// is trusted to the same degree as the user running clusterd.
+
+using namespace std;
+using namespace boost;
+
+template <typename Metric>
+class ModelServer
+{
+public:
+  typedef kmcluster::BasicCentroidModel<Metric>  model_t;
+  typedef std::shared_ptr<const model_t>         model_ptr;
+
+  ModelServer (size_t nClusters, uint64_t seed, size_t nThreads)
+    : _model ()
+    , _nClusters (nClusters)
+    , _seed (seed)
+    , _threads (nThreads)
+    , _nextVersion (1)
+    , _reloading (false)
+    , _reloader ()
+  { }
+
+  ~ModelServer ()
+  {
+    if (_reloader.joinable())
+      _reloader.join ();
+  }
+
+  /**
+   * build a model from fname and put it in service
+   */
+  void load (const string& fname)
+  {
+    std::atomic_store (&_model, build (fname));
+  }
+
+  /**
+   * accept connections on path forever, one thread per connection
+   */
+  void serve (const string& path)
+  {
+    int listener = kmcluster::listenSocket (path);
+    cerr << "listening on " << path << endl;
+    while (true)
+      {
+        int fd = accept (listener, 0, 0);
+        if (fd < 0)
+          {
+            if (errno != EINTR)
+              cerr << "accept failed: " << strerror (errno) << endl;
+            continue;
+          }
+        std::thread (&ModelServer<Metric>::handle, this, fd).detach ();
+      }
+  }
+
+private:
+  // queries read the model through atomic loads of this pointer and a
+  // reload replaces it with an atomic store, so a query in flight
+  // finishes on the model it started with, which lives on as long as
+  // the query holds it
+  model_ptr               _model;
+  size_t                  _nClusters;
+  uint64_t                _seed;
+  size_t                  _threads;
+  std::atomic<uint32_t>   _nextVersion;
+  std::atomic<bool>       _reloading;
+  std::thread             _reloader;
+
+  // a .model file is loaded as is and must be of the server's metric;
+  // any other file is a data file to train a new model with the
+  // current number of clusters on
+  model_ptr build (const string& fname)
+  {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    uint32_t version = _nextVersion++;
+    model_ptr model;
+    if (boost::ends_with (fname, ".model"))
+      model = std::make_shared<model_t> (model_t::load (fname, version));
+    else
+      {
+        bool (*parser) (const string&, kmcluster::PointND&);
+        if (boost::ends_with (fname, ".txt"))
+          parser = parseTxtLine;
+        else if (boost::ends_with (fname, ".csv"))
+          parser = parseCsvLine;
+        else
+          throw (std::runtime_error ("unknown file type: " + fname));
+
+        ifstream fin (fname.c_str());
+        if (!fin)
+          throw (std::runtime_error ("could not open file: " + fname));
+        model_ptr current = std::atomic_load (&_model);
+        size_t k = current ? current->size() : _nClusters;
+        if (k == 0)
+          throw (std::runtime_error ("training a model needs a number of clusters, see --train"));
+        kmcluster::BasicKMeansClusterND<double,Metric> clusters (k);
+        clusters.setSeed (_seed);
+        clusters.setThreads (_threads);
+        string line;
+        kmcluster::PointND pt;
+        while (getline (fin, line))
+          if (parser (line, pt))
+            clusters.add (pt);
+        clusters.cluster ();
+        model = std::make_shared<model_t> (clusters.centers (), version);
+      }
+    if (model->size() == 0)
+      throw (std::runtime_error ("no centers in " + fname));
+    double seconds = std::chrono::duration<double> (std::chrono::steady_clock::now() - start).count();
+    cerr << boost::format ("model %d: %d centers of dimension %d, %s, from %s in %.2f s\n")
+      % version % model->size() % model->dims() % Metric::name() % fname % seconds;
+    return model;
+  }
+
+  // start building a model from fname on a thread of its own, unless a
+  // reload is already running
+  bool reloadInBackground (const string& fname)
+  {
+    bool idle = false;
+    if (!_reloading.compare_exchange_strong (idle, true))
+      return false;
+    if (_reloader.joinable())
+      _reloader.join ();
+    _reloader = std::thread (&ModelServer<Metric>::reload, this, fname);
+    return true;
+  }
+
+  void reload (string fname)
+  {
+    try
+      {
+        model_ptr model = build (fname);
+        std::atomic_store (&_model, model);
+      }
+    catch (std::exception& e)
+      {
+        cerr << "reload from " << fname << " failed: " << e.what() << endl;
+      }
+    _reloading = false;
+  }
+
+  void respond (int fd, uint32_t status, uint32_t n, uint32_t d, uint32_t version)
+  {
+    kmcluster::ModelResponse response;
+    response.magic   = kmcluster::MODEL_RESPONSE_MAGIC;
+    response.status  = status;
+    response.n       = n;
+    response.d       = d;
+    response.version = version;
+    kmcluster::socketWriteAll (fd, &response, sizeof(response));
+  }
+
+  // answer the requests of one connection until the client closes it.
+  // The buffers grow to the largest batch seen and are reused after.
+  void handle (int fd)
+  {
+    std::vector<double>   points;
+    std::vector<uint32_t> ids;
+    std::vector<char>     name;
+    try
+      {
+        kmcluster::ModelRequest request;
+        while (kmcluster::socketReadAll (fd, &request, sizeof(request)))
+          {
+            if (request.magic != kmcluster::MODEL_REQUEST_MAGIC)
+              throw (std::runtime_error ("bad request magic"));
+
+            model_ptr model = std::atomic_load (&_model);
+            switch (request.op)
+              {
+              case kmcluster::MODEL_ASSIGN:
+                {
+                  if ((uint64_t)request.n * request.d > kmcluster::MODEL_MAX_VALUES)
+                    throw (std::runtime_error ("request too large"));
+                  points.resize ((size_t)request.n * request.d);
+                  if (points.size() > 0 && !kmcluster::socketReadAll (fd, &points[0], points.size()*sizeof(double)))
+                    throw (std::runtime_error ("socket closed before the points of a request"));
+                  if (request.d != model->dims())
+                    {
+                      respond (fd, kmcluster::MODEL_WRONG_DIMS, 0, model->dims(), model->version());
+                      break;
+                    }
+                  ids.resize (request.n);
+                  if (request.n > 0)
+                    model->assign (&points[0], request.n, &ids[0]);
+                  respond (fd, kmcluster::MODEL_OK, request.n, request.d, model->version());
+                  if (request.n > 0)
+                    kmcluster::socketWriteAll (fd, &ids[0], ids.size()*sizeof(uint32_t));
+                  break;
+                }
+
+              case kmcluster::MODEL_INFO:
+                respond (fd, kmcluster::MODEL_OK, model->size(), model->dims(), model->version());
+                break;
+
+              case kmcluster::MODEL_RELOAD:
+                {
+                  if (request.n == 0 || request.n > 4096)
+                    throw (std::runtime_error ("bad file name length"));
+                  name.resize (request.n);
+                  if (!kmcluster::socketReadAll (fd, &name[0], name.size()))
+                    throw (std::runtime_error ("socket closed before the file name of a request"));
+                  bool started = reloadInBackground (string (name.begin(), name.end()));
+                  respond (fd, started ? kmcluster::MODEL_OK : kmcluster::MODEL_BUSY,
+                           0, model->dims(), model->version());
+                  break;
+                }
+
+              default:
+                respond (fd, kmcluster::MODEL_BAD_REQUEST, 0, 0, model->version());
+                throw (std::runtime_error ((boost::format ("unknown op %d") % request.op).str()));
+              }
+          }
+      }
+    catch (std::exception& e)
+      {
+        cerr << "dropping connection: " << e.what() << endl;
+      }
+    close (fd);
+  }
+};
+
+template <typename Metric>
+void serveWithMetric (const string& socketPath, const string& source,
+                      size_t nClusters, uint64_t seed, size_t nThreads)
+{
+  ModelServer<Metric> server (nClusters, seed, nThreads);
+  server.load (source);
+  server.serve (socketPath);
+}
+
+int main (int argc, char ** argv)
+{
+  if (argc < 4)
+    {
+      cerr << "usage: clusterd SOCKET (--model FILE | --train FILE K [--metric NAME]) "
+           << "[--seed N] [--threads N]" << endl;
+      exit(-1);
+    }
+  string   socketPath = argv[1];
+  string   source;
+  size_t   nClusters  = 0;
+  string   metric;
+  uint64_t seed       = 1;
+  size_t   nThreads   = 1;
+  for (int i=2; i<argc; i++)
+    {
+      string opt = argv[i];
+      if (opt == "--model" && i+1 < argc)
+        source = argv[++i];
+      else if (opt == "--train" && i+2 < argc)
+        {
+          source    = argv[++i];
+          nClusters = lexical_cast<size_t>(argv[++i]);
+        }
+      else if (opt == "--metric" && i+1 < argc)
+        metric = argv[++i];
+      else if (opt == "--seed" && i+1 < argc)
+        seed = lexical_cast<uint64_t>(argv[++i]);
+      else if (opt == "--threads" && i+1 < argc)
+        nThreads = lexical_cast<size_t>(argv[++i]);
+      else
+        {
+          cerr << "unknown option: " << opt << endl;
+          exit(-1);
+        }
+    }
+
+  // a model file names its metric, training takes --metric
+  if (boost::ends_with (source, ".model"))
+    {
+      string saved = kmcluster::modelMetric (source);
+      if (metric.size() > 0 && metric != saved)
+        {
+          cerr << source << " holds a " << saved << " model, not a " << metric << " one" << endl;
+          exit(-1);
+        }
+      metric = saved;
+    }
+  else if (metric.empty())
+    metric = "euclidean";
+
+  if (metric == "euclidean")
+    serveWithMetric<kmcluster::EuclideanMetric> (socketPath, source, nClusters, seed, nThreads);
+  else if (metric == "manhattan")
+    serveWithMetric<kmcluster::ManhattanMetric> (socketPath, source, nClusters, seed, nThreads);
+  else if (metric == "cosine")
+    serveWithMetric<kmcluster::CosineMetric> (socketPath, source, nClusters, seed, nThreads);
+  else if (metric == "pow64")
+    serveWithMetric<kmcluster::Pow64Metric> (socketPath, source, nClusters, seed, nThreads);
+  else
+    {
+      cerr << "unknown metric: " << metric << endl;
+      exit(-1);
+    }
+}
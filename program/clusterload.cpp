@@ -0,0 +1,197 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <boost/lexical_cast.hpp>
+#include <boost/format.hpp>
+#include <kmcluster/Random.h>
+#include <kmcluster/ModelProtocol.h>
+
+// clusterload is a load generator for clusterd: a number of clients,
+// each on its own connection, send batches of random points as fast as
+// the answers come back, and the latency of every request is reported
+// as percentiles.  With --reload it asks the server to swap models
+// while the clients run, to show queries are not paused by it.
+//
+// compile:  g++ -O2 -pthread clusterload.cpp -I../lib/ -o clusterload
+//
+//   ./clusterload /tmp/kmcluster.sock --clients 4 --requests 5000 --batch 64
+//   ./clusterload /tmp/kmcluster.sock --reload points.csv
+
+using namespace std;
+using namespace boost;
+
+// send a request header and its payload, read the answer's header
+kmcluster::ModelResponse roundTrip (int fd, uint32_t op, uint32_t n, uint32_t d,
+                                    const void* payload, size_t bytes)
+{
+  kmcluster::ModelRequest request;
+  request.magic = kmcluster::MODEL_REQUEST_MAGIC;
+  request.op    = op;
+  request.n     = n;
+  request.d     = d;
+  kmcluster::socketWriteAll (fd, &request, sizeof(request));
+  if (bytes > 0)
+    kmcluster::socketWriteAll (fd, payload, bytes);
+
+  kmcluster::ModelResponse response;
+  if (!kmcluster::socketReadAll (fd, &response, sizeof(response))
+      || response.magic != kmcluster::MODEL_RESPONSE_MAGIC)
+    throw (std::runtime_error ("bad response from server"));
+  return response;
+}
+
+// what one client saw
+struct ClientResult
+{
+  std::vector<double>  latencies;     // microseconds, one per request
+  uint32_t             firstVersion;
+  uint32_t             lastVersion;
+  size_t               errors;
+  std::string          failure;
+};
+
+void runClient (const string& path, size_t nRequests, size_t batch, size_t d,
+                double scale, uint64_t seed, size_t client, ClientResult* result)
+{
+  result->latencies.reserve (nRequests);
+  result->firstVersion = 0;
+  result->lastVersion  = 0;
+  result->errors       = 0;
+  try
+    {
+      int fd = kmcluster::connectSocket (path);
+      kmcluster::RandomStream random (seed, client);
+      std::vector<double>   points (batch*d);
+      std::vector<uint32_t> ids (batch);
+      for (size_t r=0; r<nRequests; r++)
+        {
+          for (size_t j=0; j<points.size(); j++)
+            points[j] = random.uniform (2*scale) - scale;
+
+          std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+          kmcluster::ModelResponse response = roundTrip (fd, kmcluster::MODEL_ASSIGN, batch, d,
+                                                         points.data(), points.size()*sizeof(double));
+          if (response.status == kmcluster::MODEL_OK && response.n > 0
+              && !kmcluster::socketReadAll (fd, ids.data(), response.n*sizeof(uint32_t)))
+            throw (std::runtime_error ("server closed the connection"));
+          double us = std::chrono::duration<double, std::micro> (std::chrono::steady_clock::now() - start).count();
+
+          result->latencies.push_back (us);
+          if (response.status != kmcluster::MODEL_OK)
+            result->errors++;
+          if (r == 0)
+            result->firstVersion = response.version;
+          result->lastVersion = response.version;
+        }
+      close (fd);
+    }
+  catch (std::exception& e)
+    {
+      result->failure = e.what();
+    }
+}
+
+double percentile (const std::vector<double>& sorted, double q)
+{
+  if (sorted.empty())
+    return 0.0;
+  size_t i = std::min (sorted.size()-1, (size_t)(q * sorted.size()));
+  return sorted[i];
+}
+
+int main (int argc, char ** argv)
+{
+  if (argc < 2)
+    {
+      cerr << "usage: clusterload SOCKET [--clients N] [--requests N] [--batch N] "
+           << "[--scale X] [--seed N] [--reload FILE]" << endl;
+      exit(-1);
+    }
+  string   path      = argv[1];
+  size_t   nClients  = 4;
+  size_t   nRequests = 1000;
+  size_t   batch     = 64;
+  double   scale     = 10.0;
+  uint64_t seed      = 1;
+  string   reload;
+  for (int i=2; i<argc; i++)
+    {
+      string opt = argv[i];
+      if (opt == "--clients" && i+1 < argc)
+        nClients = lexical_cast<size_t>(argv[++i]);
+      else if (opt == "--requests" && i+1 < argc)
+        nRequests = lexical_cast<size_t>(argv[++i]);
+      else if (opt == "--batch" && i+1 < argc)
+        batch = lexical_cast<size_t>(argv[++i]);
+      else if (opt == "--scale" && i+1 < argc)
+        scale = lexical_cast<double>(argv[++i]);
+      else if (opt == "--seed" && i+1 < argc)
+        seed = lexical_cast<uint64_t>(argv[++i]);
+      else if (opt == "--reload" && i+1 < argc)
+        reload = argv[++i];
+      else
+        {
+          cerr << "unknown option: " << opt << endl;
+          exit(-1);
+        }
+    }
+
+  // the model's dimension, so the random points fit it
+  int control = kmcluster::connectSocket (path);
+  kmcluster::ModelResponse info = roundTrip (control, kmcluster::MODEL_INFO, 0, 0, 0, 0);
+  cerr << boost::format ("model %d: %d centers of dimension %d\n") % info.version % info.n % info.d;
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  std::vector<ClientResult> results (nClients);
+  std::vector<std::thread>  clients;
+  for (size_t c=0; c<nClients; c++)
+    clients.push_back (std::thread (runClient, path, nRequests, batch, (size_t)info.d,
+                                    scale, seed, c, &results[c]));
+
+  if (reload.size() > 0)
+    {
+      kmcluster::ModelResponse r = roundTrip (control, kmcluster::MODEL_RELOAD, reload.size(), 0,
+                                              reload.data(), reload.size());
+      cerr << (r.status == kmcluster::MODEL_OK ? "reload started: " : "reload refused, server busy: ")
+           << reload << endl;
+    }
+
+  for (size_t c=0; c<clients.size(); c++)
+    clients[c].join ();
+  double seconds = std::chrono::duration<double> (std::chrono::steady_clock::now() - start).count();
+  close (control);
+
+  std::vector<double> latencies;
+  size_t   errors   = 0;
+  size_t   failures = 0;
+  uint32_t firstVersion = 0xffffffffu, lastVersion = 0;
+  for (size_t c=0; c<results.size(); c++)
+    {
+      if (results[c].failure.size() > 0)
+        {
+          cerr << boost::format ("client %d failed: %s\n") % c % results[c].failure;
+          failures++;
+        }
+      latencies.insert (latencies.end(), results[c].latencies.begin(), results[c].latencies.end());
+      errors      += results[c].errors;
+      firstVersion = std::min (firstVersion, results[c].firstVersion);
+      lastVersion  = std::max (lastVersion, results[c].lastVersion);
+    }
+  std::sort (latencies.begin(), latencies.end());
+  double mean = 0.0;
+  for (size_t i=0; i<latencies.size(); i++)
+    mean += latencies[i] / latencies.size();
+
+  cout << boost::format ("%d requests of %d points from %d clients in %.2f s: %.0f requests/s, %.0f points/s\n")
+    % latencies.size() % batch % nClients % seconds
+    % (latencies.size() / seconds) % (latencies.size() * batch / seconds);
+  cout << boost::format ("latency us: p50 %.1f  p99 %.1f  max %.1f  mean %.1f\n")
+    % percentile (latencies, 0.50) % percentile (latencies, 0.99)
+    % (latencies.empty() ? 0.0 : latencies.back()) % mean;
+  cout << boost::format ("errors: %d, failed clients: %d, model versions served: %d to %d\n")
+    % errors % failures % (latencies.empty() ? 0 : firstVersion) % lastVersion;
+  return errors > 0 || failures > 0 ? 1 : 0;
+}
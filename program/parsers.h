@@ -0,0 +1,43 @@
+#ifndef PROGRAM_PARSERS_H_
+#define PROGRAM_PARSERS_H_
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
+#include <kmcluster/KMeansCluster.h>
+
+// line parsers for the dense file types, shared by the programs
+
+// .txt is just a flat file with one 2D point per line
+inline bool parseTxtLine (const std::string& line, kmcluster::PointND& p)
+{
+  double x,y;
+  if (sscanf (line.c_str(), "%lf %lf", &x, &y) != 2)
+    return false;
+  p = kmcluster::PointND (x,y);
+  return true;
+}
+
+// we also support a csv format where each line is a
+// labeled points, with the label stored in the first
+// field of the csv
+inline bool parseCsvLine (const std::string& line, kmcluster::PointND& p)
+{
+  // filer out empty lines
+  if (line.size() == 0)
+    return false;
+
+  std::vector<std::string> fields;
+  boost::split (fields, line, boost::is_any_of(","));
+
+  std::vector<double> pt;
+  for (size_t i=1; i<fields.size(); i++)
+    pt.push_back (boost::lexical_cast<double>(fields[i]));
+
+  p = kmcluster::PointND (fields[0], pt);
+  return true;
+}
+
+#endif  // PROGRAM_PARSERS_H_
@@ -4,21 +4,359 @@
 #include <vector>
 #include <boost/algorithm/string.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/scoped_ptr.hpp>
+// count heap allocations, so --alloc-stats can show the clustering
+// loop does none
+#define KMCLUSTER_COUNT_ALLOCATIONS
+#include <kmcluster/AllocationCounter.h>
 #include <kmcluster/KMeansCluster.h>
+#include <kmcluster/KMeansClusterSparse.h>
+#include <kmcluster/KMeansCluster2D.h>
+#include <kmcluster/ShardedKMeansCluster.h>
+#include <kmcluster/MixedPrecision.h>
+#include <kmcluster/CentroidModel.h>
+#include "parsers.h"
 
 // compile:  g++ testcluster.cpp ../random/rand_isaac.cpp -I../.. -o cluster
 
 using namespace std;
 using namespace boost;
 
+// sparse points are read in the libsvm format, one point per line:
+// a label followed by space separated column:value pairs.  Columns
+// that are not listed are zero.
+void readSparse (ifstream& fin, kmcluster::KMeansClusterSparse& clusters)
+{
+  string line;
+  while (getline (fin, line))
+    {
+      boost::trim (line);
+      if (line.size() == 0 || line[0] == '#')
+        continue;
+
+      vector<string> fields;
+      boost::split (fields, line, boost::is_any_of(" \t"), boost::token_compress_on);
+
+      vector<kmcluster::sparse_entry_t> entries;
+      for (size_t i=1; i<fields.size(); i++)
+        {
+          size_t colon = fields[i].find (':');
+          if (colon == string::npos)
+            {
+              cerr << "malformed sparse entry: " << fields[i] << endl;
+              exit(-1);
+            }
+          entries.push_back (make_pair (lexical_cast<unsigned int>(fields[i].substr (0, colon)),
+                                        lexical_cast<double>(fields[i].substr (colon+1))));
+        }
+
+      clusters.add (fields[0], entries);
+    }
+}
+
+// settings that follow the file name and cluster count
+struct Options
+{
+  size_t   coresetSize;
+  size_t   nShards;
+  bool     numa;
+  string   checkpoint;
+  int      checkpointEvery;
+  string   resume;
+  uint64_t seed;
+  size_t   nThreads;
+  bool     allocStats;
+  bool     useFloat;
+  bool     validateFloat;
+  bool     blocked;
+  size_t   nProbes;
+  bool     probeCheck;
+  bool     bisect;
+  int      refinePasses;
+  string   metric;
+  kmcluster::Profiler* profiler;   // null unless --profile
+  bool     profileJson;
+  kmcluster::PointOrder pointOrder;
+  bool     dedup;
+  string   saveModel;
+  int      maxIterations;
+  bool     delaunay;
+  bool     delaunayCheck;
+};
+
+// load the points of a dense file and cluster them, on either double
+// or float storage
+template <typename Clusterer>
+void clusterDense (Clusterer& clusters, int nClusters, const string& fname,
+                   const kmcluster::ShardedKMeansClusterND::parser_t& parser,
+                   const Options& opts)
+{
+  clusters.setSeed (opts.seed);
+  clusters.setMaxIterations (opts.maxIterations);
+  clusters.setThreads (opts.nThreads);
+  clusters.setBlockedDistances (opts.blocked);
+  clusters.setApproximateSearch (opts.nProbes);
+  clusters.setProfiler (opts.profiler);
+  clusters.setPointOrder (opts.pointOrder);
+
+  {
+    kmcluster::ProfileScope scope (opts.profiler, "load");
+    ifstream fin (fname.c_str());
+    string line;
+    kmcluster::PointND pt;
+    while (getline (fin, line))
+      if (parser (line, pt))
+        clusters.add (pt);
+  }
+
+  if (opts.dedup)
+    {
+      kmcluster::ProfileScope scope (opts.profiler, "dedup");
+      size_t nPoints = clusters.size();
+      clusters.deduplicate ();
+      cerr << boost::format ("dedup: %d distinct of %d points\n") % clusters.size() % nPoints;
+    }
+  
+  {
+    kmcluster::ProfileScope scope (opts.profiler, "cluster");
+    if (opts.checkpoint.size() > 0)
+      clusters.setCheckpoint (opts.checkpoint, opts.checkpointEvery);
+  
+    if (opts.resume.size() > 0)
+      clusters.resume (opts.resume);
+    else if (opts.coresetSize > 0)
+      {
+        // cluster a weighted sample, then label every point with the
+        // centers found on it
+        Clusterer summary (nClusters);
+        summary.setSeed (opts.seed);
+        summary.setMaxIterations (opts.maxIterations);
+        summary.setThreads (opts.nThreads);
+        summary.setProfiler (opts.profiler);
+        summary.setPointOrder (opts.pointOrder);
+        double scale = clusters.coreset (opts.coresetSize, summary);
+        cerr << boost::format ("coreset: %d of %d points, relative error scale %.3f\n")
+          % summary.size() % clusters.size() % scale;
+        clusters.assign (summary.cluster ());
+      }
+    else if (opts.bisect)
+      {
+        clusters.clusterBisecting (opts.refinePasses);
+        cerr << boost::format ("bisecting: %d leaves, tree depth %d\n")
+          % clusters.tree().leaves().size() % clusters.tree().depth();
+      }
+    else
+      clusters.cluster ();
+  }
+  //cout << clusters.str () << endl;
+
+  // the centers, for clusterd to serve with the same metric
+  if (opts.saveModel.size() > 0)
+    kmcluster::BasicCentroidModel<typename Clusterer::metric_type> (clusters.centers ()).save (opts.saveModel);
+
+  if (opts.probeCheck)
+    cerr << boost::format ("approximate search: %d of %d points off their exact nearest center\n")
+      % clusters.approximateFlips() % clusters.size();
+
+  if (opts.allocStats)
+    cerr << boost::format ("allocations: %d in clustering loop, %d arena blocks, %d labels, %d total\n")
+      % clusters.loopAllocations() % clusters.arenaAllocations() % clusters.labelCount()
+      % kmcluster::heapAllocations();
+}
+
+template <typename Metric>
+void clusterWithMetric (int nClusters, const string& fname,
+                        const kmcluster::ShardedKMeansClusterND::parser_t& parser,
+                        const Options& opts)
+{
+  // float storage halves the memory of points and centers; the
+  // validation run clusters on both and reports how far they differ
+  if (opts.validateFloat)
+    {
+      kmcluster::BasicKMeansClusterND<double,Metric> exact (nClusters);
+      kmcluster::BasicKMeansClusterND<float,Metric>  mixed (nClusters);
+      // the exact run alone writes the checkpoint and model files
+      Options mixedOpts = opts;
+      mixedOpts.checkpoint.clear ();
+      mixedOpts.saveModel.clear ();
+      clusterDense (exact, nClusters, fname, parser, opts);
+      clusterDense (mixed, nClusters, fname, parser, mixedOpts);
+      cerr << kmcluster::mixedPrecisionReport (exact, mixed);
+      kmcluster::ProfileScope scope (opts.profiler, "output");
+      cout << exact.clusterSets () << endl;
+    }
+  else if (opts.useFloat)
+    {
+      kmcluster::BasicKMeansClusterND<float,Metric> clusters (nClusters);
+      clusterDense (clusters, nClusters, fname, parser, opts);
+      kmcluster::ProfileScope scope (opts.profiler, "output");
+      cout << clusters.clusterSets () << endl;
+    }
+  else
+    {
+      kmcluster::BasicKMeansClusterND<double,Metric> clusters (nClusters);
+      clusterDense (clusters, nClusters, fname, parser, opts);
+      kmcluster::ProfileScope scope (opts.profiler, "output");
+      cout << clusters.clusterSets () << endl;
+    }
+}
+
+// the options given that a sharded run does not support: the workers
+// run plain euclidean k-means on double points in input order
+std::vector<string> shardConflicts (const Options& opts)
+{
+  std::vector<string> given;
+  if (opts.metric != "euclidean")               given.push_back ("--metric");
+  if (opts.useFloat)                            given.push_back ("--float");
+  if (opts.validateFloat)                       given.push_back ("--validate-float");
+  if (opts.dedup)                               given.push_back ("--dedup");
+  if (opts.coresetSize > 0)                     given.push_back ("--coreset");
+  if (opts.checkpoint.size() > 0)               given.push_back ("--checkpoint");
+  if (opts.resume.size() > 0)                   given.push_back ("--resume");
+  if (opts.bisect)                              given.push_back ("--bisect");
+  if (opts.refinePasses > 0)                    given.push_back ("--refine");
+  if (opts.pointOrder != kmcluster::INPUT_ORDER) given.push_back ("--order");
+  if (opts.nThreads != 1)                       given.push_back ("--threads");
+  if (opts.blocked)                             given.push_back ("--blocked");
+  if (opts.nProbes > 0)                         given.push_back ("--nprobe");
+  if (opts.probeCheck)                          given.push_back ("--nprobe-check");
+  if (opts.allocStats)                          given.push_back ("--alloc-stats");
+  if (opts.delaunay)                            given.push_back ("--delaunay");
+  return given;
+}
+
+// the per phase summary of --profile, on stderr
+void reportProfile (const Options& opts)
+{
+  if (opts.profiler == 0)
+    return;
+  cerr << (opts.profileJson ? opts.profiler->json () : opts.profiler->table ());
+}
+
 int main (int argc, char ** argv)
 {
   string fname     = argv[1];
   int    nClusters = atoi(argv[2]);
+
+  Options opts;
+  opts.coresetSize     = 0;
+  opts.nShards         = 0;
+  opts.numa            = false;
+  opts.checkpointEvery = 1;
+  opts.seed            = 1;
+  opts.nThreads        = 1;
+  opts.allocStats      = false;
+  opts.useFloat        = false;
+  opts.validateFloat   = false;
+  opts.blocked         = false;
+  opts.nProbes         = 0;
+  opts.probeCheck      = false;
+  opts.bisect          = false;
+  opts.refinePasses    = 0;
+  opts.metric          = "euclidean";
+  opts.profiler        = 0;
+  opts.profileJson     = false;
+  opts.pointOrder      = kmcluster::INPUT_ORDER;
+  opts.dedup           = false;
+  opts.maxIterations   = 0;
+  opts.delaunay        = false;
+  opts.delaunayCheck   = false;
+  bool profile         = false;
+  for (int i=3; i<argc; i++)
+    {
+      string opt = argv[i];
+      if (opt == "--coreset" && i+1 < argc)
+        opts.coresetSize = lexical_cast<size_t>(argv[++i]);
+      else if (opt == "--shards" && i+1 < argc)
+        opts.nShards = lexical_cast<size_t>(argv[++i]);
+      else if (opt == "--numa")
+        opts.numa = true;
+      else if (opt == "--checkpoint" && i+1 < argc)
+        opts.checkpoint = argv[++i];
+      else if (opt == "--checkpoint-every" && i+1 < argc)
+        opts.checkpointEvery = lexical_cast<int>(argv[++i]);
+      else if (opt == "--resume" && i+1 < argc)
+        opts.resume = argv[++i];
+      else if (opt == "--seed" && i+1 < argc)
+        opts.seed = lexical_cast<uint64_t>(argv[++i]);
+      else if (opt == "--threads" && i+1 < argc)
+        opts.nThreads = lexical_cast<size_t>(argv[++i]);
+      else if (opt == "--alloc-stats")
+        opts.allocStats = true;
+      else if (opt == "--float")
+        opts.useFloat = true;
+      else if (opt == "--validate-float")
+        opts.validateFloat = true;
+      else if (opt == "--blocked")
+        opts.blocked = true;
+      else if (opt == "--nprobe" && i+1 < argc)
+        opts.nProbes = lexical_cast<size_t>(argv[++i]);
+      else if (opt == "--nprobe-check")
+        opts.probeCheck = true;
+      else if (opt == "--bisect")
+        opts.bisect = true;
+      else if (opt == "--refine" && i+1 < argc)
+        opts.refinePasses = lexical_cast<int>(argv[++i]);
+      else if (opt == "--metric" && i+1 < argc)
+        opts.metric = argv[++i];
+      else if (opt == "--order" && i+1 < argc)
+        {
+          string order = argv[++i];
+          if (order == "input")
+            opts.pointOrder = kmcluster::INPUT_ORDER;
+          else if (order == "morton")
+            opts.pointOrder = kmcluster::MORTON_ORDER;
+          else if (order == "hilbert")
+            opts.pointOrder = kmcluster::HILBERT_ORDER;
+          else if (order == "assignment")
+            opts.pointOrder = kmcluster::ASSIGNMENT_ORDER;
+          else
+            {
+              cerr << "unknown point order: " << order << endl;
+              exit(-1);
+            }
+        }
+      else if (opt == "--save-model" && i+1 < argc)
+        opts.saveModel = argv[++i];
+      else if (opt == "--dedup")
+        opts.dedup = true;
+      else if (opt == "--max-iterations" && i+1 < argc)
+        opts.maxIterations = lexical_cast<int>(argv[++i]);
+      else if (opt == "--delaunay")
+        opts.delaunay = true;
+      else if (opt == "--delaunay-check")
+        opts.delaunay = opts.delaunayCheck = true;
+      else if (opt == "--profile")
+        profile = true;
+      else if (opt == "--profile-json")
+        profile = opts.profileJson = true;
+      else
+        {
+          cerr << "unknown option: " << opt << endl;
+          exit(-1);
+        }
+    }
   
-  rps::KMeansClusterND clusters (nClusters);
+  if (opts.nShards > 0)
+    {
+      std::vector<string> conflicts = shardConflicts (opts);
+      if (!conflicts.empty())
+        {
+          cerr << "--shards can not be combined with " << boost::join (conflicts, ", ") << endl;
+          exit(-1);
+        }
+    }
 
-  // we support two different file types
+  // timers start here, so argument parsing is the only thing missing
+  // from the total
+  boost::scoped_ptr<kmcluster::Profiler> profiler;
+  if (profile)
+    {
+      profiler.reset (new kmcluster::Profiler ());
+      opts.profiler = profiler.get ();
+    }
+
+  // we support three different file types
   // .txt is just a flat file with one 2D point per line
   ifstream fin (fname.c_str());
   if (!fin)
@@ -27,51 +365,118 @@ int main (int argc, char ** argv)
       exit(-1);
     }
 
-  if (boost::ends_with (fname, ".txt"))
+  // .svm/.libsvm files hold sparse high dimensional points, which are
+  // clustered without ever expanding them to dense vectors
+  if (boost::ends_with (fname, ".svm") || boost::ends_with (fname, ".libsvm"))
     {
-      do
+      if (opts.saveModel.size() > 0)
         {
-          double x,y;
-          fin >> x >> y;
-          if (!fin.eof ())
-            {
-              rps::PointND pt(x,y);
-              clusters.add (pt);
-            }
+          cerr << "--save-model needs dense points, not a sparse file: " << fname << endl;
+          exit(-1);
         }
-      while (!fin.eof());
+      kmcluster::KMeansClusterSparse sparse (nClusters);
+      sparse.setSeed (opts.seed);
+      sparse.setMaxIterations (opts.maxIterations);
+      {
+        kmcluster::ProfileScope scope (opts.profiler, "load");
+        readSparse (fin, sparse);
+      }
+      {
+        kmcluster::ProfileScope scope (opts.profiler, "cluster");
+        sparse.cluster ();
+      }
+      {
+        kmcluster::ProfileScope scope (opts.profiler, "output");
+        cout << sparse.clusterSets () << endl;
+      }
+      reportProfile (opts);
+      return 0;
     }
 
-  // we also support a csv format where each line is a
-  // labeled points, with the label stored in the first
-  // field of the csv
-  else if (boost::ends_with (fname, ".csv"))
+  // the 2D clusterer, which finds nearest centers by a point location
+  // in the Delaunay triangulation of the centers
+  if (opts.delaunay)
     {
-      //cout << "doing csv\n";
-      string line;
-      while (!fin.eof())
+      if (!boost::ends_with (fname, ".txt"))
         {
-          getline (fin, line);
-
-          // filer out empty lines
-          if (line.size() == 0)
-            continue;
-
-          vector<string> fields;
-          boost::split (fields, line, boost::is_any_of(","));
+          cerr << "--delaunay needs 2D points in a .txt file: " << fname << endl;
+          exit(-1);
+        }
+      std::vector< std::pair<double,double> > points;
+      {
+        kmcluster::ProfileScope scope (opts.profiler, "load");
+        string line;
+        kmcluster::PointND pt;
+        while (getline (fin, line))
+          if (parseTxtLine (line, pt))
+            points.push_back (std::make_pair (pt.x[0], pt.x[1]));
+      }
+      kmcluster::KMeansCluster2D clusters (points, nClusters);
+      clusters.setSeed (opts.seed);
+      clusters.setDelaunaySearch (true);
+      {
+        kmcluster::ProfileScope scope (opts.profiler, "cluster");
+        clusters.cluster ();
+      }
+      if (opts.delaunayCheck)
+        cerr << boost::format ("delaunay search: %d of %d points off their scanned nearest center\n")
+          % clusters.delaunayFlips() % points.size();
+      {
+        kmcluster::ProfileScope scope (opts.profiler, "output");
+        cout << clusters.str () << endl;
+      }
+      reportProfile (opts);
+      return 0;
+    }
 
-          vector<double> pt;
-          for (size_t i=1; i<fields.size(); i++)
-            pt.push_back (lexical_cast<double>(fields[i]));
+  kmcluster::ShardedKMeansClusterND::parser_t parser;
+  if (boost::ends_with (fname, ".txt"))
+    parser = parseTxtLine;
+  else if (boost::ends_with (fname, ".csv"))
+    parser = parseCsvLine;
+  else
+    {
+      cerr << "unknown file type: " << fname << endl;
+      exit(-1);
+    }
 
-          clusters.add (rps::PointND(fields[0], pt));
-        }
+  // sharded runs leave the loading to the worker processes, each of
+  // which reads only its own part of the file
+  if (opts.nShards > 0)
+    {
+      kmcluster::ShardedKMeansClusterND sharded (nClusters, opts.nShards);
+      sharded.setSeed (opts.seed);
+      sharded.setMaxIterations (opts.maxIterations);
+      sharded.setNumaPinning (opts.numa);
+      sharded.setProfiler (opts.profiler);
+      std::vector<kmcluster::PointND> centers;
+      {
+        kmcluster::ProfileScope scope (opts.profiler, "cluster");
+        centers = sharded.cluster (fname, parser);
+      }
+      // shards always cluster with the euclidean distance
+      if (opts.saveModel.size() > 0)
+        kmcluster::CentroidModel (centers).save (opts.saveModel);
+      {
+        kmcluster::ProfileScope scope (opts.profiler, "output");
+        cout << sharded.clusterSets () << endl;
+      }
+      reportProfile (opts);
+      return 0;
     }
-  
-  //srand ();
-  
-  clusters.cluster ();
-  //cout << clusters.str () << endl;
 
-  cout << clusters.clusterSets () << endl;
+  if (opts.metric == "euclidean")
+    clusterWithMetric<kmcluster::EuclideanMetric> (nClusters, fname, parser, opts);
+  else if (opts.metric == "manhattan")
+    clusterWithMetric<kmcluster::ManhattanMetric> (nClusters, fname, parser, opts);
+  else if (opts.metric == "cosine")
+    clusterWithMetric<kmcluster::CosineMetric> (nClusters, fname, parser, opts);
+  else if (opts.metric == "pow64")
+    clusterWithMetric<kmcluster::Pow64Metric> (nClusters, fname, parser, opts);
+  else
+    {
+      cerr << "unknown metric: " << opts.metric << endl;
+      exit(-1);
+    }
+  reportProfile (opts);
 }